@@ -0,0 +1,595 @@
+#include "stdafx.h"
+#include <jd/base/Profile.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <map>
+
+// One thread's ring.  The owning thread is the only writer of head, depth and skipDepth;
+// ProfileFlush() is the only writer of tail, and reads events between tail and head.
+struct ProfileRawEvent
+{
+    int64 ticks;
+    const char * name;      // NULL for the end of a zone
+};
+
+struct ProfileRing
+{
+    ProfileRawEvent * events;
+    uint64 mask;                    // ring size - 1
+    std::atomic<uint64> head;
+    std::atomic<uint64> tail;
+    int depth;                      // zones open on the owning thread, recorded or not
+    int skipDepth;                  // depth of the outermost dropped zone, or -1
+    std::atomic<int64> dropped;
+    std::atomic<bool> alive;        // cleared when the owning thread exits
+    int thread;                     // id in the trace
+    std::string name;
+};
+
+// A collected event; name is an index into traceNames, or -1 for an end
+struct ProfileTraceEvent
+{
+    int64 ticks;
+    int thread;
+    int name;
+};
+
+// Everything below is only touched with traceLock held.
+static std::mutex traceLock;
+static std::vector<ProfileRing*> rings;
+static int nextThread = 1;
+static std::vector<ProfileTraceEvent> traceEvents;
+static std::vector<std::string> traceNames;
+static std::map<std::string, int> traceNameIndex;
+static std::map<const char *, int> tracePointerIndex;
+static std::map<int, std::string> traceThreadNames;
+static double traceSecondsPerTick = 0.0;
+
+static std::atomic<int> eventsPerThread( 65536 );
+
+static thread_local ProfileRing * currentRing = NULL;
+
+static void ClearTrace();
+
+// hands the ring back when its thread exits
+struct ProfileRingOwner
+{
+    bool armed;
+    ~ProfileRingOwner()
+    {
+        if( armed && currentRing )
+        {
+            currentRing->alive.store( false, std::memory_order_release );
+        }
+    }
+};
+static thread_local ProfileRingOwner currentRingOwner;
+
+static ProfileRing * RegisterThread()
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    ProfileRing * ring = NULL;
+    // a dead thread's ring, once flushed, can be reused
+    for( size_t i = 0; i < rings.size() && !ring; i++ )
+    {
+        ProfileRing * r = rings[i];
+        if( !r->alive.load( std::memory_order_acquire )
+            && r->head.load( std::memory_order_relaxed ) == r->tail.load( std::memory_order_relaxed ) )
+        {
+            ring = r;
+        }
+    }
+    if( !ring )
+    {
+        uint64 size = 16;
+        while( size < (uint64)eventsPerThread.load( std::memory_order_relaxed ) )
+        {
+            size *= 2;
+        }
+        ring = new ProfileRing;
+        ring->events = new ProfileRawEvent[size];
+        ring->mask = size - 1;
+        ring->head.store( 0, std::memory_order_relaxed );
+        ring->tail.store( 0, std::memory_order_relaxed );
+        ring->dropped.store( 0, std::memory_order_relaxed );
+        rings.push_back( ring );
+    }
+    ring->depth = 0;
+    ring->skipDepth = -1;
+    ring->thread = nextThread++;
+    ring->name.clear();
+    ring->alive.store( true, std::memory_order_relaxed );
+
+    currentRing = ring;
+    currentRingOwner.armed = true;
+    return ring;
+}
+
+void ProfileSystemInit( int events )
+{
+    eventsPerThread.store( events > 0 ? events : 65536, std::memory_order_relaxed );
+}
+
+void ProfileSystemShutdown()
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    ClearTrace();
+    // free the rings of threads that have exited and been flushed; live threads keep theirs
+    size_t kept = 0;
+    for( size_t i = 0; i < rings.size(); i++ )
+    {
+        ProfileRing * r = rings[i];
+        if( !r->alive.load( std::memory_order_acquire )
+            && r->head.load( std::memory_order_relaxed ) == r->tail.load( std::memory_order_relaxed ) )
+        {
+            delete[] r->events;
+            delete r;
+        }
+        else
+        {
+            rings[kept++] = r;
+        }
+    }
+    rings.resize( kept );
+}
+
+void ProfileSetThreadName( const char * name )
+{
+    ProfileRing * ring = currentRing ? currentRing : RegisterThread();
+    std::lock_guard<std::mutex> lock( traceLock );
+    ring->name = name ? name : "";
+}
+
+void ProfileBegin( const char * name )
+{
+    ProfileRing * r = currentRing ? currentRing : RegisterThread();
+    if( r->skipDepth >= 0 )
+    {
+        r->depth++;
+        r->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+    const uint64 h = r->head.load( std::memory_order_relaxed );
+    const uint64 used = h - r->tail.load( std::memory_order_acquire );
+    // keep room for the end of every zone that's open, this one included
+    if( used + (uint64)r->depth + 2 > r->mask + 1 )
+    {
+        r->skipDepth = r->depth++;
+        r->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+    ProfileRawEvent & e = r->events[h & r->mask];
+    e.ticks = GetTimeTicks();
+    e.name = name;
+    r->head.store( h + 1, std::memory_order_release );
+    r->depth++;
+}
+
+void ProfileEnd()
+{
+    const int64 ticks = GetTimeTicks();
+    ProfileRing * r = currentRing;
+    if( !r || r->depth == 0 )
+    {
+        return;     // no zone open
+    }
+    r->depth--;
+    if( r->skipDepth >= 0 )
+    {
+        if( r->depth == r->skipDepth )
+        {
+            r->skipDepth = -1;
+        }
+        return;
+    }
+    const uint64 h = r->head.load( std::memory_order_relaxed );
+    ProfileRawEvent & e = r->events[h & r->mask];
+    e.ticks = ticks;
+    e.name = NULL;
+    r->head.store( h + 1, std::memory_order_release );
+}
+
+static int NameIndex( const std::string & name )
+{
+    std::map<std::string, int>::iterator it = traceNameIndex.find( name );
+    if( it != traceNameIndex.end() )
+    {
+        return it->second;
+    }
+    const int index = (int)traceNames.size();
+    traceNames.push_back( name );
+    traceNameIndex[name] = index;
+    return index;
+}
+
+static int NameIndex( const char * name )
+{
+    std::map<const char *, int>::iterator it = tracePointerIndex.find( name );
+    if( it != tracePointerIndex.end() )
+    {
+        return it->second;
+    }
+    const int index = NameIndex( std::string( name ) );
+    tracePointerIndex[name] = index;
+    return index;
+}
+
+int ProfileFlush()
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    traceSecondsPerTick = TicksToSeconds( 1000000000 ) / 1.0e9;
+    int moved = 0;
+    for( size_t i = 0; i < rings.size(); i++ )
+    {
+        ProfileRing * r = rings[i];
+        uint64 t = r->tail.load( std::memory_order_relaxed );
+        const uint64 h = r->head.load( std::memory_order_acquire );
+        for( ; t != h; t++ )
+        {
+            const ProfileRawEvent & raw = r->events[t & r->mask];
+            ProfileTraceEvent e;
+            e.ticks = raw.ticks;
+            e.thread = r->thread;
+            e.name = raw.name ? NameIndex( raw.name ) : -1;
+            traceEvents.push_back( e );
+            moved++;
+        }
+        r->tail.store( h, std::memory_order_release );
+        if( !r->name.empty() )
+        {
+            traceThreadNames[r->thread] = r->name;
+        }
+    }
+    return moved;
+}
+
+int64 ProfileDroppedZones()
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    int64 dropped = 0;
+    for( size_t i = 0; i < rings.size(); i++ )
+    {
+        dropped += rings[i]->dropped.load( std::memory_order_relaxed );
+    }
+    return dropped;
+}
+
+static void ClearTrace()
+{
+    traceEvents.clear();
+    traceNames.clear();
+    traceNameIndex.clear();
+    tracePointerIndex.clear();
+    traceThreadNames.clear();
+}
+
+void ProfileClear()
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    ClearTrace();
+}
+
+//
+// Chrome trace_event JSON
+//
+
+static void WriteJsonString( FILE * f, const std::string & s )
+{
+    fputc( '"', f );
+    for( size_t i = 0; i < s.size(); i++ )
+    {
+        const unsigned char c = (unsigned char)s[i];
+        if( c == '"' || c == '\\' )
+        {
+            fputc( '\\', f );
+            fputc( c, f );
+        }
+        else if( c < 0x20 )
+        {
+            fprintf( f, "\\u%04x", c );
+        }
+        else
+        {
+            fputc( c, f );
+        }
+    }
+    fputc( '"', f );
+}
+
+bool ProfileWriteChromeTrace( const char * path )
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+    FILE * f = fopen( path, "wb" );
+    if( !f )
+    {
+        return false;
+    }
+
+    // timestamps are microseconds from the first event
+    int64 base = 0;
+    for( size_t i = 0; i < traceEvents.size(); i++ )
+    {
+        if( i == 0 || traceEvents[i].ticks < base )
+        {
+            base = traceEvents[i].ticks;
+        }
+    }
+    const double usPerTick = traceSecondsPerTick * 1.0e6;
+
+    fprintf( f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+    bool first = true;
+    for( std::map<int, std::string>::const_iterator it = traceThreadNames.begin(); it != traceThreadNames.end(); ++it )
+    {
+        fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", it->first );
+        WriteJsonString( f, it->second );
+        fprintf( f, "}}" );
+        first = false;
+    }
+    for( size_t i = 0; i < traceEvents.size(); i++ )
+    {
+        const ProfileTraceEvent & e = traceEvents[i];
+        const double ts = (double)(e.ticks - base) * usPerTick;
+        fprintf( f, "%s{", first ? "" : ",\n" );
+        if( e.name >= 0 )
+        {
+            fprintf( f, "\"name\":" );
+            WriteJsonString( f, traceNames[e.name] );
+            fprintf( f, ",\"ph\":\"B\"" );
+        }
+        else
+        {
+            fprintf( f, "\"ph\":\"E\"" );
+        }
+        fprintf( f, ",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", ts, e.thread );
+        first = false;
+    }
+    fprintf( f, "\n]}\n" );
+    return fclose( f ) == 0;
+}
+
+//
+// Binary form, all integers little-endian:
+//   "JDPROF1\n"
+//   double seconds per tick, int64 base ticks (8 bytes each)
+//   varint name count, then each name as varint length + bytes
+//   varint thread count, then per thread:
+//     varint id, varint name length + bytes, varint event count,
+//     then per event: varint (name index + 1, 0 for an end), varint zigzag(ticks - previous ticks)
+//
+
+static const char binaryMagic[8] = { 'J', 'D', 'P', 'R', 'O', 'F', '1', '\n' };
+
+static void PutVarint( std::vector<uint8> & out, uint64 v )
+{
+    while( v >= 0x80 )
+    {
+        out.push_back( (uint8)(v | 0x80) );
+        v >>= 7;
+    }
+    out.push_back( (uint8)v );
+}
+
+static void PutFixed( std::vector<uint8> & out, uint64 v )
+{
+    for( int i = 0; i < 8; i++ )
+    {
+        out.push_back( (uint8)(v >> (8 * i)) );
+    }
+}
+
+static void PutString( std::vector<uint8> & out, const std::string & s )
+{
+    PutVarint( out, s.size() );
+    out.insert( out.end(), s.begin(), s.end() );
+}
+
+bool ProfileWriteBinary( const char * path )
+{
+    std::lock_guard<std::mutex> lock( traceLock );
+
+    std::map<int, std::vector<size_t> > byThread;
+    int64 base = 0;
+    for( size_t i = 0; i < traceEvents.size(); i++ )
+    {
+        byThread[traceEvents[i].thread].push_back( i );
+        if( i == 0 || traceEvents[i].ticks < base )
+        {
+            base = traceEvents[i].ticks;
+        }
+    }
+    for( std::map<int, std::string>::const_iterator it = traceThreadNames.begin(); it != traceThreadNames.end(); ++it )
+    {
+        byThread[it->first];    // named threads with no events keep their names
+    }
+
+    std::vector<uint8> out( binaryMagic, binaryMagic + 8 );
+    uint64 scaleBits;
+    memcpy( &scaleBits, &traceSecondsPerTick, sizeof(scaleBits) );
+    PutFixed( out, scaleBits );
+    PutFixed( out, (uint64)base );
+    PutVarint( out, traceNames.size() );
+    for( size_t i = 0; i < traceNames.size(); i++ )
+    {
+        PutString( out, traceNames[i] );
+    }
+    PutVarint( out, byThread.size() );
+    for( std::map<int, std::vector<size_t> >::const_iterator it = byThread.begin(); it != byThread.end(); ++it )
+    {
+        PutVarint( out, (uint64)it->first );
+        std::map<int, std::string>::const_iterator name = traceThreadNames.find( it->first );
+        PutString( out, name != traceThreadNames.end() ? name->second : std::string() );
+        PutVarint( out, it->second.size() );
+        int64 prev = base;
+        for( size_t i = 0; i < it->second.size(); i++ )
+        {
+            const ProfileTraceEvent & e = traceEvents[it->second[i]];
+            const int64 delta = e.ticks - prev;
+            prev = e.ticks;
+            PutVarint( out, (uint64)(e.name + 1) );
+            PutVarint( out, ((uint64)delta << 1) ^ (uint64)(delta >> 63) );
+        }
+    }
+
+    FILE * f = fopen( path, "wb" );
+    if( !f )
+    {
+        return false;
+    }
+    const bool wrote = fwrite( &out[0], 1, out.size(), f ) == out.size();
+    return (fclose( f ) == 0) && wrote;
+}
+
+struct ProfileReader
+{
+    const uint8 * p;
+    const uint8 * end;
+    bool ok;
+
+    uint64 Varint()
+    {
+        uint64 v = 0;
+        for( int shift = 0; shift < 64; shift += 7 )
+        {
+            if( p >= end )
+            {
+                break;
+            }
+            const uint8 b = *p++;
+            v |= (uint64)(b & 0x7f) << shift;
+            if( !(b & 0x80) )
+            {
+                return v;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    uint64 Fixed()
+    {
+        if( end - p < 8 )
+        {
+            ok = false;
+            return 0;
+        }
+        uint64 v = 0;
+        for( int i = 0; i < 8; i++ )
+        {
+            v |= (uint64)p[i] << (8 * i);
+        }
+        p += 8;
+        return v;
+    }
+
+    uint64 Remaining() const
+    {
+        return (uint64)(end - p);
+    }
+
+    // a count of items that take at least minBytes each; fails rather than trust one the file can't hold
+    uint64 Count( uint64 minBytes )
+    {
+        const uint64 n = Varint();
+        if( n > Remaining() / minBytes )
+        {
+            ok = false;
+            return 0;
+        }
+        return n;
+    }
+
+    std::string String()
+    {
+        const uint64 n = Varint();
+        if( !ok || (uint64)(end - p) < n )
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string s( (const char *)p, (size_t)n );
+        p += n;
+        return s;
+    }
+};
+
+bool ProfileReadBinary( const char * path )
+{
+    FILE * f = fopen( path, "rb" );
+    if( !f )
+    {
+        return false;
+    }
+    std::vector<uint8> data;
+    uint8 buf[4096];
+    size_t n;
+    while( (n = fread( buf, 1, sizeof(buf), f )) > 0 )
+    {
+        data.insert( data.end(), buf, buf + n );
+    }
+    fclose( f );
+    if( data.size() < 8 || memcmp( &data[0], binaryMagic, 8 ) != 0 )
+    {
+        return false;
+    }
+
+    ProfileReader in = { &data[0] + 8, &data[0] + data.size(), true };
+    const uint64 scaleBits = in.Fixed();
+    const int64 base = (int64)in.Fixed();
+    std::vector<std::string> names( (size_t)in.Count( 1 ) );
+    for( size_t i = 0; i < names.size() && in.ok; i++ )
+    {
+        names[i] = in.String();
+    }
+    std::vector<ProfileTraceEvent> events;
+    std::map<int, std::string> threadNames;
+    const uint64 threads = in.Count( 3 );     // id, name length, event count
+    for( uint64 t = 0; t < threads && in.ok; t++ )
+    {
+        const int thread = (int)in.Varint();
+        const std::string name = in.String();
+        if( !name.empty() )
+        {
+            threadNames[thread] = name;
+        }
+        const uint64 count = in.Count( 2 );     // name, tick delta
+        int64 prev = base;
+        for( uint64 i = 0; i < count && in.ok; i++ )
+        {
+            // names are stored plus one, so 0 is an end event (-1) and anything past the table is corrupt
+            const uint64 name = in.Varint();
+            if( name > names.size() )
+            {
+                in.ok = false;
+                break;
+            }
+            ProfileTraceEvent e;
+            e.name = (int)name - 1;
+            const uint64 zz = in.Varint();
+            prev += (int64)(zz >> 1) ^ -(int64)(zz & 1);
+            e.ticks = prev;
+            e.thread = thread;
+            events.push_back( e );
+        }
+    }
+    if( !in.ok )
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock( traceLock );
+    ClearTrace();
+    traceNames = names;
+    for( size_t i = 0; i < traceNames.size(); i++ )
+    {
+        traceNameIndex[traceNames[i]] = (int)i;
+    }
+    traceEvents = events;
+    traceThreadNames = threadNames;
+    memcpy( &traceSecondsPerTick, &scaleBits, sizeof(traceSecondsPerTick) );
+    return true;
+}
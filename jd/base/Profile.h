@@ -0,0 +1,94 @@
+#pragma once
+
+#include <jd/base/plat.h>
+#include <jd/base/build.h>
+#include <jd/base/lang.h>
+#include <jd/base/Timing.h>
+
+// JD_PROFILING: whether JD_PROFILE_SCOPE records anything.  Off in customer builds, where the
+// zones expand to nothing at all.  The functions below still exist; they just never see an event.
+#ifndef JD_PROFILING
+#define JD_PROFILING (!DEPLOY_TO_CUSTOMER)
+#endif
+
+// Profile -- nested timing zones, recorded per thread and exported as a trace.
+//
+// Each thread records begin/end events (a GetTimeTicks() stamp and the zone's name pointer) into its
+// own ring buffer.  Recording takes no lock and doesn't allocate, apart from setting up the thread's
+// buffer on its first event.  ProfileFlush() moves whatever the rings hold into one trace, and can run
+// on any thread while the others keep recording; call it every frame or so, since a full ring drops
+// new zones (whole zones, nested ones included, so the trace stays balanced) until it's flushed.
+//
+// Zone names are stored by pointer until the flush, so they must outlive it: string literals.
+//
+// EXAMPLE:
+//   void UpdateParticles()
+//   {
+//       JD_PROFILE_SCOPE( "UpdateParticles" );
+//       { JD_PROFILE_SCOPE( "integrate" ); ... }
+//       { JD_PROFILE_SCOPE( "sort" ); ... }
+//   }
+//
+//   // once a frame
+//   ProfileFlush();
+//
+//   // at exit, then open it at ui.perfetto.dev or chrome://tracing
+//   ProfileWriteChromeTrace( "trace.json" );
+
+EXTERN_C_BEGIN
+
+// Set the ring size, in events, of threads that start recording after this; 0 for the default (65536).
+void ProfileSystemInit( int eventsPerThread );
+// Drop the collected trace, and free the rings of finished threads that have been flushed.  Until then
+// a thread keeps its ring for as long as it lives, and a finished thread's ring is handed to the next
+// new thread once it has been flushed.
+void ProfileSystemShutdown();
+
+// Name the calling thread in the trace.
+void ProfileSetThreadName( const char * name );
+
+void ProfileBegin( const char * name );
+void ProfileEnd();
+
+// Move every thread's recorded events into the trace.  Returns how many were moved.
+int ProfileFlush();
+
+// Zones dropped so far because a ring was full.
+int64 ProfileDroppedZones();
+
+// Drop the collected trace (events still in the rings are kept for the next flush).
+void ProfileClear();
+
+// Write the collected trace as Chrome trace_event JSON.
+bool ProfileWriteChromeTrace( const char * path );
+
+// Write / read the collected trace in a compact binary form: a name table, then each thread's events
+// as varint (name, tick delta) pairs.  Reading replaces the collected trace, so a capture can be
+// saved on the device and turned into JSON later with ProfileReadBinary() + ProfileWriteChromeTrace().
+bool ProfileWriteBinary( const char * path );
+bool ProfileReadBinary( const char * path );
+
+EXTERN_C_END
+
+#ifdef __cplusplus
+
+// ProfileScope: a zone for the lifetime of the object.  Use JD_PROFILE_SCOPE rather than this,
+// so customer builds compile it out.
+class ProfileScope
+{
+public:
+    explicit ProfileScope( const char * name ) { ProfileBegin( name ); }
+    ~ProfileScope() { ProfileEnd(); }
+
+private:
+    ProfileScope( const ProfileScope & );
+    ProfileScope & operator=( const ProfileScope & );
+};
+
+#if JD_PROFILING
+#define JD_PROFILE_SCOPE(name) ProfileScope MACRO_CONCAT3( profileScope_, __LINE__, _ )( name )
+#else
+#define JD_PROFILE_SCOPE(name)
+#endif
+
+#endif
@@ -1,5 +1,5 @@
 #include "stdafx.h"
-#include <jd/base/plat.h>
+#include <jd/base/base.h>
 #include <jd/base/Timing.h>
 
 #if TARGET_OS_IPHONE || TARGET_OS_MAC
@@ -29,6 +29,21 @@ TimeSample GetTimeSampleSeconds()
     return ((double)mach_absolute_time()) * osTimeToSecondsScale;
 }
 
+TimeTicks GetTimeTicks()
+{
+    return (TimeTicks)mach_absolute_time();
+}
+
+TimeSample TicksToSeconds( TimeTicks ticks )
+{
+    return (double)ticks * osTimeToSecondsScale;
+}
+
+TimeTicks SecondsToTicks( TimeSample seconds )
+{
+    return (TimeTicks)(seconds / osTimeToSecondsScale);
+}
+
 EXTERN_C_END
 
 #elif TARGET_OS_WINDOWS
@@ -59,6 +74,24 @@ TimeSample GetTimeSampleSeconds()
     return time.QuadPart * osTimeToSecondsScale;
 }
 
+TimeTicks GetTimeTicks()
+{
+    LARGE_INTEGER time;
+    BOOL ok = QueryPerformanceCounter(&time);
+    ASSERT(ok);
+    return (TimeTicks)time.QuadPart;
+}
+
+TimeSample TicksToSeconds( TimeTicks ticks )
+{
+    return (double)ticks * osTimeToSecondsScale;
+}
+
+TimeTicks SecondsToTicks( TimeSample seconds )
+{
+    return (TimeTicks)(seconds / osTimeToSecondsScale);
+}
+
 #elif TARGET_OS_ANDROID
 
 #include <unistd.h>
@@ -93,6 +126,169 @@ TimeSample GetTimeSampleSeconds()
     return (double)spec.tv_sec + ((double)spec.tv_nsec) / 1000000000.0;
 }
 
+// ticks are nanoseconds
+TimeTicks GetTimeTicks()
+{
+    timespec spec;
+    VERIFY( clock_gettime(CLOCK_MONOTONIC,&spec) == 0 );
+    return (TimeTicks)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+TimeSample TicksToSeconds( TimeTicks ticks )
+{
+    return (double)ticks * 1.0e-9;
+}
+
+TimeTicks SecondsToTicks( TimeSample seconds )
+{
+    return (TimeTicks)(seconds * 1.0e9);
+}
+
+#elif TARGET_OS_LINUX
+
+#include <time.h>
+
+// TIMING_USE_TSC: on x86, read the invariant timestamp counter instead of calling clock_gettime.
+// rdtsc is a handful of nanoseconds where even the vDSO clock_gettime is a few tens, which matters
+// once timestamps go around every task.  TimeSystemInit() measures the counter's rate against
+// CLOCK_MONOTONIC_RAW, and only switches over if the CPU says the counter is invariant
+// (constant rate, and it keeps running in deep sleep states).
+#ifndef TIMING_USE_TSC
+#define TIMING_USE_TSC (TARGET_CPU_X86_64 || TARGET_CPU_i386)
+#endif
+
+#if TIMING_USE_TSC
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+static bool useTsc = false;
+static uint64 tscBase = 0;
+static TimeSample tscBaseSeconds = 0.0;
+static double osTimeToSecondsScale = 0.0;  // seconds per tsc tick
+static double ticksToSecondsScale = 1.0e-9; // TimeTicks are tsc ticks when useTsc, otherwise nanoseconds
+
+// CLOCK_MONOTONIC_RAW isn't slewed by NTP, so short intervals measure the hardware, not the adjustments
+static TimeSample MonotonicRawSeconds()
+{
+    timespec spec;
+    VERIFY( clock_gettime(CLOCK_MONOTONIC_RAW, &spec) == 0 );
+    return (double)spec.tv_sec + ((double)spec.tv_nsec) / 1000000000.0;
+}
+
+#if TIMING_USE_TSC
+
+static bool HasInvariantTsc()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if( !__get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) )
+    {
+        return false;
+    }
+    return (edx & (1u << 8)) != 0;
+}
+
+// one (tsc, clock) pair: the clock read with the tightest pair of tsc reads around it out of a few tries,
+// so a preemption in the middle of one doesn't skew the calibration
+static void SampleTscAndClock( uint64 & tsc, TimeSample & seconds )
+{
+    uint64 best = ~0ull;
+    for( int i = 0; i < 8; i++ )
+    {
+        const uint64 before = __rdtsc();
+        const TimeSample s = MonotonicRawSeconds();
+        const uint64 after = __rdtsc();
+        if( after - before < best )
+        {
+            best = after - before;
+            tsc = before + (after - before) / 2;
+            seconds = s;
+        }
+    }
+}
+
+#endif
+
+void TimeSystemInit()
+{
+    useTsc = false;
+#if TIMING_USE_TSC
+    if( HasInvariantTsc() )
+    {
+        // 20ms between samples puts the rate within a few parts per million
+        uint64 tsc0 = 0, tsc1 = 0;
+        TimeSample s0 = 0.0, s1 = 0.0;
+        SampleTscAndClock( tsc0, s0 );
+        timespec wait = { 0, 20 * 1000 * 1000 };
+        nanosleep( &wait, NULL );
+        SampleTscAndClock( tsc1, s1 );
+
+        if( tsc1 > tsc0 && s1 > s0 )
+        {
+            osTimeToSecondsScale = (s1 - s0) / (double)(tsc1 - tsc0);
+            tscBase = tsc1;
+            tscBaseSeconds = s1;
+            // anything outside 100MHz..10GHz means the counter or the clock isn't what we think
+            const double hz = 1.0 / osTimeToSecondsScale;
+            useTsc = hz > 1.0e8 && hz < 1.0e10;
+        }
+    }
+#endif
+    ticksToSecondsScale = useTsc ? osTimeToSecondsScale : 1.0e-9;
+}
+
+void TimeSystemShutdown()
+{
+}
+
+bool TimeSystemUsesTSC()
+{
+    return useTsc;
+}
+
+// Same timebase either way: the tsc is pinned to CLOCK_MONOTONIC_RAW at init.
+// Before TimeSystemInit() (or without an invariant tsc) this is just clock_gettime.
+TimeSample GetTimeSampleSeconds()
+{
+#if TIMING_USE_TSC
+    if( useTsc )
+    {
+        return tscBaseSeconds + (double)(int64)(__rdtsc() - tscBase) * osTimeToSecondsScale;
+    }
+#endif
+    return MonotonicRawSeconds();
+}
+
+TimeTicks GetTimeTicks()
+{
+#if TIMING_USE_TSC
+    if( useTsc )
+    {
+        return (TimeTicks)__rdtsc();
+    }
+#endif
+    timespec spec;
+    VERIFY( clock_gettime(CLOCK_MONOTONIC_RAW, &spec) == 0 );
+    return (TimeTicks)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+TimeSample TicksToSeconds( TimeTicks ticks )
+{
+    return (double)ticks * ticksToSecondsScale;
+}
+
+TimeTicks SecondsToTicks( TimeSample seconds )
+{
+    return (TimeTicks)(seconds / ticksToSecondsScale);
+}
+
+#endif
+
+#if !TARGET_OS_LINUX
+bool TimeSystemUsesTSC()
+{
+    return false;
+}
 #endif
 
 
@@ -145,3 +341,53 @@ TimeSample SimpleTimer::GetElapsedTimeSinceMark() const
     }
     return GetTimeSampleSeconds() - markTime;
 }
+
+
+
+// SimpleTickTimer
+SimpleTickTimer::SimpleTickTimer() : startTime(0), markTime(0) { }
+
+TimeTicks SimpleTickTimer::Start()
+{
+    startTime = GetTimeTicks();
+    markTime = startTime;
+    return startTime;
+}
+
+TimeTicks SimpleTickTimer::Mark()
+{
+    if ( startTime != 0 )
+    {
+        markTime = GetTimeTicks();
+        TimeTicks total = markTime - startTime;
+        startTime = markTime;
+        return total;
+    }
+    return 0;
+}
+
+void SimpleTickTimer::Reset()
+{
+    startTime = 0;
+    markTime = 0;
+}
+
+TimeTicks SimpleTickTimer::GetElapsedTicks() const
+{
+    if ( startTime == 0 )
+    {
+        // the clock wasn't started yet
+        return 0;
+    }
+    return GetTimeTicks() - startTime;
+}
+
+TimeTicks SimpleTickTimer::GetElapsedTicksSinceMark() const
+{
+    if ( startTime == 0 )
+    {
+        // the clock wasn't started yet
+        return 0;
+    }
+    return GetTimeTicks() - markTime;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <jd/base/plat.h>
 #include <jd/base/build.h>
 #include <jd/base/lang.h>
 
@@ -18,6 +19,23 @@ void TimeSystemShutdown();
 // Return the current system clock time in seconds
 TimeSample GetTimeSampleSeconds();
 
+// True if GetTimeSampleSeconds() reads the CPU's timestamp counter rather than asking the OS
+// (Linux on x86 with an invariant TSC, after TimeSystemInit()).
+bool TimeSystemUsesTSC();
+
+// TimeTicks: the raw counter behind GetTimeSampleSeconds(), in its own units (TSC ticks, mach ticks,
+// QPC counts or nanoseconds, depending on the platform), with an arbitrary origin.
+// Reading it skips the int-to-double conversion and scaling, and differences are exact however long
+// the process has been up, so hot-path instrumentation can store ticks and convert when it reports.
+// The unit is fixed by TimeSystemInit(); don't mix ticks read before it with ticks read after.
+typedef int64 TimeTicks;
+
+TimeTicks GetTimeTicks();
+
+// Convert a tick count (normally a difference of two GetTimeTicks() values) to seconds, and back
+TimeSample TicksToSeconds( TimeTicks ticks );
+TimeTicks SecondsToTicks( TimeSample seconds );
+
 EXTERN_C_END
 
 #ifdef __cplusplus
@@ -56,4 +74,43 @@ private:
     TimeSample markTime;
 };
 
+// SimpleTickTimer: SimpleTimer in TimeTicks, for timing that runs often enough
+// to be worth keeping the conversion to seconds out of it.
+class SimpleTickTimer
+{
+public:
+    SimpleTickTimer();
+    
+    // start timer and return starting tick count.
+    // if timer was already started, clear first.
+    TimeTicks Start();
+    
+    // mark a split time, and return elapsed ticks since start,
+    // or return zero if timer hasn't been started
+    TimeTicks Mark();
+
+    // clear timer, set start time to zero
+    void Reset();
+
+    bool IsStarted() const {return startTime != 0;}
+    
+    TimeTicks GetStartTime() const {return startTime;}
+    TimeTicks GetMarkTime() const {return markTime;}
+    
+    // samples and returns ticks elapsed since start time, or zero if not started
+    TimeTicks GetElapsedTicks() const;
+    
+    // samples and returns ticks elapsed since last mark time,
+    // or since start time if no mark occured yet, or zero if not started
+    TimeTicks GetElapsedTicksSinceMark() const;
+
+    // the same, converted to seconds
+    TimeSample GetElapsedTime() const {return TicksToSeconds( GetElapsedTicks() );}
+    TimeSample GetElapsedTimeSinceMark() const {return TicksToSeconds( GetElapsedTicksSinceMark() );}
+    
+private:
+    TimeTicks startTime;
+    TimeTicks markTime;
+};
+
 #endif
@@ -36,7 +36,7 @@ EXTERN_C_END
 #define DEBUG_BREAK()
 #define ASSERT(XXX)
 // VERIFY always executes the statement.  
-#define VERIFY(XXX) (XXX)
+#define VERIFY(XXX) ((void)(XXX))
 #endif
 
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define TARGET_OS_LINUX 1
+
+#if defined(__x86_64__)
+#define TARGET_CPU_X86_64 1
+#elif defined(__i386__)
+#define TARGET_CPU_i386 1
+#elif defined(__aarch64__)
+#define TARGET_CPU_ARM64 1
+#elif defined(__arm__)
+#define TARGET_CPU_ARM 1
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define TARGET_ENDIAN_LITTLE    0
+#define TARGET_ENDIAN_BIG       1
+#else
+#define TARGET_ENDIAN_LITTLE    1
+#define TARGET_ENDIAN_BIG       0
+#endif
+
+
+// types
+typedef uint64_t            uint64;
+typedef int64_t             int64;
+typedef uint32_t            uint32;
+typedef int32_t             int32;
+typedef uint16_t            uint16;
+typedef int16_t             int16;
+typedef uint8_t             uint8;
+typedef int8_t              int8;
+typedef uint8_t             byte;
+
+typedef float               real32;
+typedef double              real64;
+
+
+
+// all platform-specific POD types are defined by now
+typedef uint32          FourCharCode;
+typedef FourCharCode    OSType;
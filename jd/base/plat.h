@@ -1,8 +1,8 @@
 #pragma once
 
 // ConfigPlatform_* headers should be set up these conditionals:
-// TARGET_OS_{WINDOWS|IPHONE|MAC}
-// TARGET_CPU_{i386|ARM}
+// TARGET_OS_{WINDOWS|IPHONE|MAC|ANDROID|LINUX}
+// TARGET_CPU_{i386|X86_64|ARM|ARM64}
 // TARGET_ENDIAN_{LITTLE|BIG}
 
 #ifdef WIN32
@@ -13,4 +13,6 @@
 #include <jd/base/mac/plat_mac.h>
 #elif ANDROID
 #include <jd/base/android/plat_android.h>
+#elif defined(__linux__)
+#include <jd/base/linux/plat_linux.h>
 #endif
@@ -0,0 +1,157 @@
+#include "stdafx.h"
+#include <jd/bench/baseline.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace jd {
+namespace bench {
+
+namespace {
+
+const char * const magic = "jd-bench-baseline";
+
+bool read_line(FILE * f, std::string & line) {
+	line.clear();
+	int c;
+	while((c = fgetc(f)) != EOF && c != '\n') {
+		if(c != '\r') {
+			line.push_back((char)c);
+		}
+	}
+	return c != EOF || !line.empty();
+}
+
+// the text after "key " on a line, or nullptr if the line is some other key
+const char * value_of(const std::string & line, const char * key) {
+	const size_t n = strlen(key);
+	if(line.compare(0, n, key) != 0 || (line.size() > n && line[n] != ' ')) {
+		return nullptr;
+	}
+	return line.c_str() + (line.size() > n ? n + 1 : n);
+}
+
+bool fail(std::string * error, const char * path, int line, const char * what) {
+	if(error) {
+		char buf[64] = ": ";
+		if(line > 0) {
+			snprintf(buf, sizeof(buf), ":%d: ", line);
+		}
+		*error = std::string(path) + buf + what;
+	}
+	return false;
+}
+
+} // namespace
+
+baseline make_baseline(const std::string & label, const runner & r) {
+	baseline b;
+	b.label = label;
+	b.clock = TimeSystemUsesTSC() ? "tsc" : "os";
+	b.outlier_iqr = r.get_options().outlier_iqr;
+	b.results = r.results();
+	return b;
+}
+
+bool write_baseline(const char * path, const std::string & label, const runner & r) {
+	return write_baseline(path, make_baseline(label, r));
+}
+
+bool write_baseline(const char * path, const baseline & b) {
+	FILE * f = fopen(path, "wb");
+	if(!f) {
+		return false;
+	}
+	std::string label = b.label;
+	for(char & c : label) {
+		if(c == '\n' || c == '\r') {
+			c = ' ';
+		}
+	}
+	fprintf(f, "%s %d\n", magic, baseline_version);
+	fprintf(f, "label %s\n", label.c_str());
+	fprintf(f, "clock %s\n", b.clock.c_str());
+	fprintf(f, "outlier_iqr %.9g\n", b.outlier_iqr);
+	for(const result & r : b.results) {
+		fprintf(f, "benchmark %llu %d %s\n", (unsigned long long)r.iterations, (int)r.samples.size(), r.name.c_str());
+		for(size_t s = 0; s < r.samples.size(); s++) {
+			fprintf(f, "%s%.9g", s ? " " : "", r.samples[s]);
+		}
+		fprintf(f, "\n");
+	}
+	return fclose(f) == 0;
+}
+
+bool read_baseline(const char * path, baseline & b, std::string * error) {
+	FILE * f = fopen(path, "rb");
+	if(!f) {
+		return fail(error, path, 0, "can't open");
+	}
+	b = baseline();
+	std::string line;
+	int at = 1;
+	bool ok = true;
+	const char * v;
+	if(!read_line(f, line) || !(v = value_of(line, magic))) {
+		ok = fail(error, path, at, "not a benchmark baseline");
+	} else if(atoi(v) != baseline_version) {
+		ok = fail(error, path, at, "unsupported baseline version");
+	}
+	while(ok && read_line(f, line)) {
+		at++;
+		if(line.empty()) {
+			continue;
+		}
+		if((v = value_of(line, "label"))) {
+			b.label = v;
+		} else if((v = value_of(line, "clock"))) {
+			b.clock = v;
+		} else if((v = value_of(line, "outlier_iqr"))) {
+			b.outlier_iqr = atof(v);
+		} else if((v = value_of(line, "benchmark"))) {
+			result r;
+			unsigned long long iterations = 0;
+			int count = 0, name_at = 0;
+			if(sscanf(v, "%llu %d %n", &iterations, &count, &name_at) < 2 || count < 0 || !v[name_at]) {
+				ok = fail(error, path, at, "bad benchmark line");
+				break;
+			}
+			r.name = v + name_at;
+			r.iterations = iterations;
+			at++;
+			if(!read_line(f, line)) {
+				ok = fail(error, path, at, "missing samples");
+				break;
+			}
+			// every sample takes a digit and a separator, so don't allocate for more than the line can hold
+			if((size_t)count > (line.size() + 1) / 2) {
+				ok = fail(error, path, at, "wrong number of samples");
+				break;
+			}
+			const char * p = line.c_str();
+			r.samples.reserve(count);
+			for(int s = 0; s < count; s++) {
+				char * end;
+				const double x = strtod(p, &end);
+				if(end == p) {
+					break;
+				}
+				r.samples.push_back(x);
+				p = end;
+			}
+			if((int)r.samples.size() != count) {
+				ok = fail(error, path, at, "wrong number of samples");
+				break;
+			}
+			r.outliers = summarize(r.samples, b.outlier_iqr, r.stats);
+			b.results.push_back(std::move(r));
+		}
+		// unknown keys are skipped, so a version 1 reader copes with fields added without a version bump
+	}
+	fclose(f);
+	return ok;
+}
+
+} // namespace bench
+} // namespace jd
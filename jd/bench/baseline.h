@@ -0,0 +1,43 @@
+#pragma once
+
+#include <jd/bench/bench.h>
+
+#include <vector>
+#include <string>
+
+namespace jd {
+namespace bench {
+
+// Baseline files -- a run's raw samples saved so a later run (another build, another version of the
+// library) can be compared with it.  Plain text, so they diff and check in:
+//
+//   jd-bench-baseline 1
+//   label <free text, e.g. the version or commit measured>
+//   clock tsc
+//   outlier_iqr 1.5
+//   benchmark <iterations per sample> <sample count> <name>
+//   <samples in ns per iteration, space separated>
+//   benchmark ...
+//
+// The first line carries the format version.  read_baseline() refuses versions it doesn't know rather
+// than guess; bump baseline_version whenever the layout changes.
+const int baseline_version = 1;
+
+struct baseline {
+	std::string label;
+	std::string clock;              // "tsc" or "os": samples taken on different clocks compare less well
+	double outlier_iqr = 1.5;       // what the stats were summarized with
+	std::vector<result> results;    // stats recomputed from the samples on read
+};
+
+bool write_baseline(const char * path, const std::string & label, const runner & r);
+bool write_baseline(const char * path, const baseline & b);
+
+// On failure returns false and, if error is given, says why.
+bool read_baseline(const char * path, baseline & b, std::string * error = nullptr);
+
+// The results of a run, as a baseline.
+baseline make_baseline(const std::string & label, const runner & r);
+
+} // namespace bench
+} // namespace jd
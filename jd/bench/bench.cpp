@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include <jd/bench/bench.h>
+
+#include <cstring>
+
+namespace jd {
+namespace bench {
+
+namespace {
+
+struct sample_value {
+	double operator()(std::vector<double>::const_iterator i) const { return *i; }
+};
+
+void write_json_string(FILE * f, const std::string & s) {
+	fputc('"', f);
+	for(char ch : s) {
+		const unsigned char c = (unsigned char)ch;
+		if(c == '"' || c == '\\') {
+			fputc('\\', f);
+			fputc(c, f);
+		} else if(c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+// names go in quotes, doubling any quote inside, so commas can't split a row
+void write_csv_string(FILE * f, const std::string & s) {
+	fputc('"', f);
+	for(char c : s) {
+		if(c == '"') {
+			fputc('"', f);
+		}
+		fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+} // namespace
+
+int summarize(const std::vector<double> & samples, double outlier_iqr, SomeStats<double> & stats) {
+	stats = CalcSomeStats<double>(samples.begin(), (int)samples.size(), sample_value());
+	if(outlier_iqr <= 0 || samples.size() < 4) {
+		return 0;
+	}
+	const double iqr = stats.uq - stats.lq;
+	const double lo = stats.lq - outlier_iqr * iqr;
+	const double hi = stats.uq + outlier_iqr * iqr;
+	std::vector<double> kept;
+	kept.reserve(samples.size());
+	for(double s : samples) {
+		if(s >= lo && s <= hi) {
+			kept.push_back(s);
+		}
+	}
+	if(kept.size() != samples.size()) {
+		stats = CalcSomeStats<double>(kept.begin(), (int)kept.size(), sample_value());
+	}
+	return (int)(samples.size() - kept.size());
+}
+
+void runner::print(FILE * f) const {
+	fprintf(f, "%-44s %12s %12s %12s %12s %10s %8s\n", "benchmark", "median ns", "lq ns", "uq ns", "stddev ns", "iters", "outliers");
+	for(const result & r : done) {
+		fprintf(f, "%-44s %12.2f %12.2f %12.2f %12.2f %10llu %5d/%-2d\n", r.name.c_str(), r.stats.med, r.stats.lq, r.stats.uq,
+			r.stats.stddev, (unsigned long long)r.iterations, r.outliers, (int)r.samples.size());
+	}
+}
+
+bool runner::write_json(const char * path) const {
+	FILE * f = fopen(path, "wb");
+	if(!f) {
+		return false;
+	}
+	fprintf(f, "{\n\"clock\": \"%s\",\n\"benchmarks\": [", TimeSystemUsesTSC() ? "tsc" : "os");
+	for(size_t i = 0; i < done.size(); i++) {
+		const result & r = done[i];
+		fprintf(f, "%s\n{\"name\": ", i ? "," : "");
+		write_json_string(f, r.name);
+		fprintf(f, ", \"iterations\": %llu, \"outliers\": %d,\n", (unsigned long long)r.iterations, r.outliers);
+		fprintf(f, " \"median_ns\": %.9g, \"lq_ns\": %.9g, \"uq_ns\": %.9g, \"mean_ns\": %.9g, \"stddev_ns\": %.9g, \"min_ns\": %.9g, \"max_ns\": %.9g,\n",
+			r.stats.med, r.stats.lq, r.stats.uq, r.stats.mean, r.stats.stddev, r.stats.min, r.stats.max);
+		fprintf(f, " \"samples_ns\": [");
+		for(size_t s = 0; s < r.samples.size(); s++) {
+			fprintf(f, "%s%.9g", s ? ", " : "", r.samples[s]);
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n]\n}\n");
+	return fclose(f) == 0;
+}
+
+bool runner::write_csv(const char * path) const {
+	FILE * f = fopen(path, "wb");
+	if(!f) {
+		return false;
+	}
+	fprintf(f, "name,iterations,samples,outliers,median_ns,lq_ns,uq_ns,mean_ns,stddev_ns,min_ns,max_ns\n");
+	for(const result & r : done) {
+		write_csv_string(f, r.name);
+		fprintf(f, ",%llu,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", (unsigned long long)r.iterations, (int)r.samples.size(),
+			r.outliers, r.stats.med, r.stats.lq, r.stats.uq, r.stats.mean, r.stats.stddev, r.stats.min, r.stats.max);
+	}
+	return fclose(f) == 0;
+}
+
+} // namespace bench
+} // namespace jd
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <jd/base/Timing.h>
+#include <jd/math/SomeStats.h>
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+namespace jd {
+namespace bench {
+
+// do_not_optimize -- make the compiler believe value is read, so the work that produced it can't be dropped.
+// clobber -- make it believe all memory was read and written, so stores before it can't be dropped either.
+// The non-const overload also makes it believe value changed, which stops a loop-invariant computation
+// on it from being hoisted out of the benchmark loop.
+#if defined(__GNUC__) || defined(__clang__)
+template<typename T>
+inline void do_not_optimize(const T & value) {
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+template<typename T>
+inline void do_not_optimize(T & value) {
+#if defined(__clang__)
+	asm volatile("" : "+r,m"(value) : : "memory");
+#else
+	asm volatile("" : "+m,r"(value) : : "memory");
+#endif
+}
+inline void clobber() {
+	asm volatile("" : : : "memory");
+}
+#else
+namespace detail {
+inline void escape(const void * p) {
+	static const void * volatile sink;
+	sink = p;
+}
+}
+template<typename T>
+inline void do_not_optimize(const T & value) {
+	detail::escape(&value);
+}
+inline void clobber() {
+	static volatile int sink;
+	sink = 0;
+}
+#endif
+
+struct options {
+	double warmup_seconds = 0.05;   // run the benchmark this long before sampling
+	double sample_seconds = 0.005;  // each sample runs enough iterations to take about this long
+	int samples = 30;
+	double outlier_iqr = 1.5;       // drop samples beyond this many interquartile ranges outside the quartiles (0 keeps all)
+	std::string filter;             // only run benchmarks whose name contains this
+	std::vector<std::string> only;  // if not empty, only run benchmarks with exactly these names
+};
+
+// result -- one benchmark's samples, in nanoseconds per iteration.
+// samples holds every sample, outliers included, in the order they were taken;
+// stats summarizes the ones that survived outlier rejection.
+struct result {
+	std::string name;
+	uint64_t iterations = 0;        // per sample
+	std::vector<double> samples;
+	int outliers = 0;
+	SomeStats<double> stats;
+};
+
+// Summarize samples after dropping the ones outside the Tukey fences (lq - k*iqr, uq + k*iqr).
+// Returns how many were dropped.
+int summarize(const std::vector<double> & samples, double outlier_iqr, SomeStats<double> & stats);
+
+// runner -- times benchmarks, keeps their results, and writes them out.
+//
+// EXAMPLE:
+//   jd::bench::runner r( opt );
+//   mat4x4f a = ..., b = ..., c;
+//   r.run( "mat_mul_restrict", [&]{ mat_mul_restrict( c, a, b ); jd::bench::do_not_optimize( c ); } );
+//   r.print( stdout );
+//   r.write_json( "bench.json" );
+//
+// fn is one iteration.  Each run warms up for warmup_seconds, doubling the iteration count until a batch
+// takes sample_seconds (that calibrates it), then times `samples` batches of that many iterations.
+// The clock is GetTimeTicks(), so call TimeSystemInit() first.
+class runner {
+public:
+	explicit runner(const options & o = options()) : opt(o) {}
+
+	const options & get_options() const { return opt; }
+	const std::vector<result> & results() const { return done; }
+
+	bool wants(const char * name) const {
+		if(!opt.only.empty() && std::find(opt.only.begin(), opt.only.end(), name) == opt.only.end()) {
+			return false;
+		}
+		return opt.filter.empty() || std::string(name).find(opt.filter) != std::string::npos;
+	}
+
+	// Returns the result (good until the next run() or add()), or nullptr if the filter skipped it.
+	template<typename F>
+	const result * run(const char * name, F && fn) {
+		if(!wants(name)) {
+			return nullptr;
+		}
+		const TimeTicks warmup = SecondsToTicks(opt.warmup_seconds);
+		const TimeTicks target = SecondsToTicks(opt.sample_seconds);
+		uint64_t iterations = 1;
+		const TimeTicks start = GetTimeTicks();
+		for(;;) {
+			const TimeTicks took = time_batch(fn, iterations);
+			if(took >= target) {
+				if(GetTimeTicks() - start >= warmup) {
+					break;
+				}
+				continue;
+			}
+			// aim a little past the target, but don't jump more than 10x on a noisy short batch
+			double grow = (took > 0) ? 1.2 * (double)target / (double)took : 10.0;
+			grow = (grow < 2.0) ? 2.0 : (grow > 10.0 ? 10.0 : grow);
+			iterations = (uint64_t)((double)iterations * grow);
+		}
+
+		result r;
+		r.name = name;
+		r.iterations = iterations;
+		r.samples.reserve(opt.samples);
+		for(int s = 0; s < opt.samples; s++) {
+			const TimeTicks took = time_batch(fn, iterations);
+			r.samples.push_back(TicksToSeconds(took) * 1e9 / (double)iterations);
+		}
+		r.outliers = summarize(r.samples, opt.outlier_iqr, r.stats);
+		done.push_back(std::move(r));
+		return &done.back();
+	}
+
+	// add a result measured some other way (e.g. a whole-pool throughput test)
+	void add(result && r) { done.push_back(std::move(r)); }
+
+	// a table of median, quartiles and spread per benchmark
+	void print(FILE * f) const;
+
+	// every result, with its raw samples
+	bool write_json(const char * path) const;
+	// one summary row per result
+	bool write_csv(const char * path) const;
+
+private:
+	template<typename F>
+	static TimeTicks time_batch(F & fn, uint64_t iterations) {
+		const TimeTicks t0 = GetTimeTicks();
+		for(uint64_t i = 0; i < iterations; i++) {
+			fn();
+		}
+		clobber();
+		return GetTimeTicks() - t0;
+	}
+
+	options opt;
+	std::vector<result> done;
+};
+
+} // namespace bench
+} // namespace jd
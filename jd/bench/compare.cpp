@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include <jd/bench/compare.h>
+
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+namespace jd {
+namespace bench {
+
+double mann_whitney_p(const std::vector<double> & a, const std::vector<double> & b) {
+	const size_t na = a.size(), nb = b.size();
+	if(!na || !nb) {
+		return 1;
+	}
+	const size_t n = na + nb;
+	std::vector<std::pair<double, bool>> all;     // (sample, from a)
+	all.reserve(n);
+	for(double x : a) {
+		all.push_back(std::make_pair(x, true));
+	}
+	for(double x : b) {
+		all.push_back(std::make_pair(x, false));
+	}
+	std::sort(all.begin(), all.end());
+
+	// rank sum of a, ties getting the mean of the ranks they span
+	double rank_a = 0;
+	double ties = 0;                                // sum of t^3 - t over groups of t tied samples
+	for(size_t i = 0; i < n;) {
+		size_t j = i + 1;
+		while(j < n && all[j].first == all[i].first) {
+			j++;
+		}
+		const double rank = 0.5 * (double)(i + 1 + j);  // ranks i+1 .. j
+		for(size_t k = i; k < j; k++) {
+			if(all[k].second) {
+				rank_a += rank;
+			}
+		}
+		const double t = (double)(j - i);
+		ties += t * t * t - t;
+		i = j;
+	}
+
+	const double u = rank_a - 0.5 * (double)na * (double)(na + 1);
+	const double mean = 0.5 * (double)na * (double)nb;
+	const double var = (double)na * (double)nb / 12.0 * ((double)(n + 1) - ties / ((double)n * (double)(n - 1)));
+	if(var <= 0) {
+		return 1;                                   // every sample equal
+	}
+	const double d = std::max(0.0, std::fabs(u - mean) - 0.5);
+	return std::erfc(d / std::sqrt(2.0 * var));
+}
+
+std::vector<comparison> compare(const baseline & before, const baseline & after, const compare_options & opt) {
+	std::vector<comparison> out;
+	std::vector<bool> matched(before.results.size(), false);
+	for(const result & now : after.results) {
+		comparison c;
+		c.name = now.name;
+		c.after = now.stats;
+		c.result = comparison::added;
+		for(size_t i = 0; i < before.results.size(); i++) {
+			const result & was = before.results[i];
+			if(matched[i] || was.name != now.name) {
+				continue;
+			}
+			matched[i] = true;
+			c.before = was.stats;
+			c.p = mann_whitney_p(was.samples, now.samples);
+			c.change = (was.stats.med > 0) ? now.stats.med / was.stats.med - 1 : 0;
+			c.result = comparison::same;
+			if(was.samples.size() < opt.min_samples || now.samples.size() < opt.min_samples) {
+				c.result = comparison::too_few;
+			} else if(c.p < opt.alpha && std::fabs(c.change) >= opt.min_change_of(c.name)) {
+				c.result = (c.change > 0) ? comparison::slower : comparison::faster;
+			}
+			break;
+		}
+		out.push_back(c);
+	}
+	for(size_t i = 0; i < before.results.size(); i++) {
+		if(!matched[i]) {
+			comparison c;
+			c.name = before.results[i].name;
+			c.before = before.results[i].stats;
+			c.result = comparison::removed;
+			out.push_back(c);
+		}
+	}
+	return out;
+}
+
+int print_comparison(FILE * f, const std::vector<comparison> & cs) {
+	static const char * const verdicts[] = { "", "faster", "SLOWER", "added", "removed", "too few samples", "slower once, not on rerun" };
+	int slower = 0;
+	fprintf(f, "%-44s %12s %12s %9s %9s\n", "benchmark", "before ns", "after ns", "change", "p");
+	for(const comparison & c : cs) {
+		switch(c.result) {
+		case comparison::added:
+			fprintf(f, "%-44s %12s %12.2f %9s %9s  %s\n", c.name.c_str(), "-", c.after.med, "", "", verdicts[c.result]);
+			break;
+		case comparison::removed:
+			fprintf(f, "%-44s %12.2f %12s %9s %9s  %s\n", c.name.c_str(), c.before.med, "-", "", "", verdicts[c.result]);
+			break;
+		default:
+			fprintf(f, "%-44s %12.2f %12.2f %+8.1f%% %9.2g  %s\n", c.name.c_str(), c.before.med, c.after.med,
+				100.0 * c.change, c.p, verdicts[c.result]);
+			break;
+		}
+		if(c.result == comparison::slower) {
+			slower++;
+		}
+	}
+	return slower;
+}
+
+} // namespace bench
+} // namespace jd
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <jd/bench/baseline.h>
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdio>
+
+namespace jd {
+namespace bench {
+
+// Two-sided p-value of a Mann-Whitney U test that samples a and b come from the same distribution.
+// Uses the normal approximation (with tie and continuity corrections), which is good from about
+// eight samples a side; below that it only errs on the cautious side.  Returns 1 if either is empty.
+double mann_whitney_p(const std::vector<double> & a, const std::vector<double> & b);
+
+struct compare_options {
+	double alpha = 0.01;            // a change must be at least this significant ...
+	double min_change = 0.05;       // ... and move the median by at least this fraction, to count
+	size_t min_samples = 20;        // with fewer samples on either side a benchmark can't count as changed
+
+	// (name prefix, min_change) for benchmarks noisier than the rest, e.g. ones that depend on
+	// other threads being scheduled; the first prefix that matches wins
+	std::vector<std::pair<std::string, double>> min_change_for;
+
+	double min_change_of(const std::string & name) const {
+		for(const auto & m : min_change_for) {
+			if(name.compare(0, m.first.size(), m.first) == 0) {
+				return m.second;
+			}
+		}
+		return min_change;
+	}
+};
+
+// comparison -- one benchmark in a baseline against the same one in a later run.
+// The test runs on every raw sample, outliers included (ranks don't care how far out they are);
+// the medians and change come from the SomeStats of the samples that survived outlier rejection.
+// too_few: either side had fewer than min_samples samples, so it wasn't judged.
+// unconfirmed: it came out slower, but not again when rerun (see libjd_bench --confirm).
+struct comparison {
+	enum verdict { same, faster, slower, added, removed, too_few, unconfirmed };
+
+	std::string name;
+	verdict result = same;
+	SomeStats<double> before, after;
+	double change = 0;              // after.med / before.med - 1
+	double p = 1;
+};
+
+// Compare every benchmark in either run, matched by name, in the order of the current run.
+// Only slower and faster count as changes.
+std::vector<comparison> compare(const baseline & before, const baseline & after, const compare_options & opt = compare_options());
+
+// A table of the comparisons.  Returns how many were slower.
+int print_comparison(FILE * f, const std::vector<comparison> & c);
+
+// EXAMPLE: gate a library upgrade on the old version's numbers
+//   libjd_bench --save-baseline old.baseline --label "libjd 1.4"     (built against the old version)
+//   libjd_bench --compare old.baseline                               (built against the new one; exits 3 on a regression)
+// Run both on the same quiet machine.  A single run can differ from the last by more than min_change
+// (frequency scaling, another process waking up), which is why a live --compare reruns whatever came out
+// slower: the ones slower every time are regressions, and the rest are unconfirmed, which still fails
+// the gate (exit 4) rather than passing quietly.
+
+} // namespace bench
+} // namespace jd
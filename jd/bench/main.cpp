@@ -0,0 +1,347 @@
+#include "stdafx.h"
+#include <jd/bench/bench.h>
+#include <jd/bench/baseline.h>
+#include <jd/bench/compare.h>
+#include <jd/base/Timing.h>
+#include <jd/math/mat4x4.h>
+#include <jd/math/mat3x2.h>
+#include <jd/math/quat.h>
+#include <jd/math/line2.h>
+#include <jd/math/SomeStats.h>
+#include <jd/thread/threadpool.hpp>
+#include <jd/thread/parallel.hpp>
+#include <jd/thread/parallel_sort.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// libjd_bench -- micro-benchmarks for the math kernels and jd::threadpool.
+//
+//   libjd_bench [--filter text] [--samples n] [--quick] [--json file] [--csv file]
+//               [--save-baseline file [--label text]]
+//               [--compare baseline [--against baseline] [--alpha p] [--min-change fraction]
+//                [--min-change-for prefix=fraction] [--min-samples n] [--confirm rounds]]
+//
+// Every benchmark reports nanoseconds per iteration: the median and quartiles of its samples,
+// after outliers are dropped.  --json keeps the raw samples as well.
+//
+// --save-baseline writes the run's raw samples to a baseline file (see baseline.h).  --compare runs the
+// benchmarks and compares them with a baseline; with --against it compares two saved baselines instead,
+// without running anything.  A benchmark is a regression when a Mann-Whitney test on the samples puts it
+// below --alpha (default 0.01) and its median got slower by at least --min-change (default 0.05;
+// --min-change-for prefix=fraction sets it for the benchmarks whose names start with prefix, e.g.
+// threadpool/ ones that hang on how the OS schedules the workers).  Benchmarks with fewer than
+// --min-samples (default 20) samples on either side can't be judged: --quick, which takes 10, is refused
+// with --compare, and so is saving a baseline with fewer.  A live --compare reruns whatever came out
+// slower --confirm times (default 2); one that's slower against the baseline every time is a regression,
+// and one that isn't is reported apart from the rest, as slower once.
+// The exit code is 3 if anything regressed, and 4 if nothing did but the comparison was inconclusive:
+// a benchmark was slower once but not on rerun, had too few samples, or is missing from this run.
+// Either way a build gating on it fails.
+
+using namespace jd;
+using jd::bench::do_not_optimize;
+
+namespace {
+
+struct float_value {
+	inline float operator()(const float * f) const { return *f; }
+};
+
+void bench_math(bench::runner & r) {
+	mat4x4f a, b, c;
+	mat_fromPosRot(a, vec3f(1, 2, 3), quat<float>(0.1f, 0.2f, 0.3f, 0.9f));
+	mat_fromPosRot(b, vec3f(-3, 0.5f, 2), quat<float>(0.7f, 0.1f, 0.0f, 0.7f));
+	r.run("math/mat_mul_restrict", [&]{
+		do_not_optimize(a);
+		do_not_optimize(b);
+		mat_mul_restrict(c, a, b);
+		do_not_optimize(c);
+	});
+	r.run("math/mat_invert", [&]{
+		do_not_optimize(a);
+		mat_invert(c, a);
+		do_not_optimize(c);
+	});
+
+	quat<float> q0(0.1f, 0.2f, 0.3f, 0.927f), q1(-0.5f, 0.5f, 0.1f, 0.7f), q;
+	float t = 0.37f;
+	r.run("math/QuatSlerp", [&]{
+		do_not_optimize(q0);
+		do_not_optimize(q1);
+		do_not_optimize(t);
+		q = QuatSlerp(q0, q1, t);
+		do_not_optimize(q);
+	});
+
+	// mat3x2 has a copy constructor but no copy assignment, so take the result by construction
+	mat3x2f m0(0.8f, 0.6f, -0.6f, 0.8f, 10.0f, 20.0f), m1(2.0f, 0.0f, 0.0f, 2.0f, -1.0f, 3.0f);
+	r.run("math/mat3x2_mul", [&]{
+		do_not_optimize(m0);
+		do_not_optimize(m1);
+		mat3x2f m = mat3x2_mul(m0, m1);
+		do_not_optimize(m);
+	});
+
+	vec2f a0(0, 0), a1(4, 3), b0(0, 3), b1(4, -1), p;
+	r.run("math/LineIntersect", [&]{
+		do_not_optimize(a0);
+		do_not_optimize(b0);
+		int hit = LineIntersect(a0, a1, b0, b1, true, p);
+		do_not_optimize(hit);
+		do_not_optimize(p);
+	});
+
+	std::vector<float> samples(1024);
+	for(size_t i = 0; i < samples.size(); i++) {
+		samples[i] = (float)((i * 7919u) % 1000u);
+	}
+	r.run("math/CalcSomeStats 1024", [&]{
+		SomeStats<float> s = CalcSomeStats<float>(&samples[0], (int)samples.size(), float_value());
+		do_not_optimize(s);
+	});
+}
+
+void bench_threadpool(bench::runner & r) {
+	const unsigned hw = std::thread::hardware_concurrency();
+	const int workers = hw > 1 ? (int)hw - 1 : 1;
+	threadpool tp(workers);
+
+	int x = 5;
+	r.run("threadpool/add_task round trip", [&]{
+		int v = tp.add_task([&x]{ return x; }).get();
+		do_not_optimize(v);
+	});
+
+	std::atomic<int> counter(0);
+	std::vector<task> batch(1000);
+	r.run("threadpool/1000 tasks, add_tasks", [&]{
+		for(auto & t : batch) {
+			t = task([&counter]{ counter.fetch_add(1, std::memory_order_relaxed); });
+		}
+		const int target = counter.load() + (int)batch.size();
+		tp.add_tasks(batch);
+		tp.help_until([&]{ return counter.load(std::memory_order_acquire) >= target; });
+	});
+
+	const int n = 1 << 16;
+	mat4x4f M;
+	mat_fromPosRot(M, vec3f(1, 2, 3), quat<float>(0, 0, 0, 1));
+	std::vector<vec3f> points(n), out(n);
+	for(int i = 0; i < n; i++) {
+		points[i] = vec3f((float)i, (float)(i & 255), 1.0f);
+	}
+	r.run("threadpool/parallel_for 64k mat_mulPoint", [&]{
+		parallel_for(tp, 0, n, 4096, [&](int i){ out[i] = mat_mulPoint(M, points[i]); });
+		bench::clobber();
+	});
+
+	std::vector<float> unsorted(n), sorting(n);
+	for(int i = 0; i < n; i++) {
+		unsorted[i] = (float)(((unsigned)i * 2654435761u) >> 8);
+	}
+	r.run("threadpool/parallel_sort 64k floats", [&]{
+		sorting = unsorted;
+		parallel_sort(tp, sorting.begin(), sorting.end());
+		bench::clobber();
+	});
+}
+
+void run_all(bench::runner & r) {
+	bench_math(r);
+	bench_threadpool(r);
+}
+
+// Rerun every benchmark in cs that came out slower, `rounds` times, and mark it unconfirmed
+// unless it's slower than the baseline every time.
+void confirm(std::vector<bench::comparison> & cs, const bench::baseline & before, bench::options opt,
+             const bench::compare_options & cmp, int rounds) {
+	for(int round = 1; round <= rounds; round++) {
+		opt.only.clear();
+		for(const bench::comparison & c : cs) {
+			if(c.result == bench::comparison::slower) {
+				opt.only.push_back(c.name);
+			}
+		}
+		if(opt.only.empty()) {
+			return;
+		}
+		printf("rerunning %d slower benchmark%s (%d of %d)\n", (int)opt.only.size(), opt.only.size() == 1 ? "" : "s", round, rounds);
+		bench::runner r(opt);
+		run_all(r);
+		const std::vector<bench::comparison> again = bench::compare(before, bench::make_baseline("", r), cmp);
+		for(bench::comparison & c : cs) {
+			if(c.result != bench::comparison::slower) {
+				continue;
+			}
+			bool still = false;
+			for(const bench::comparison & a : again) {
+				if(a.name == c.name) {
+					still = (a.result == bench::comparison::slower);
+					break;
+				}
+			}
+			if(!still) {
+				c.result = bench::comparison::unconfirmed;
+			}
+		}
+	}
+}
+
+} // namespace
+
+int main(int argc, char ** argv) {
+	TimeSystemInit();
+
+	bench::options opt;
+	bench::compare_options cmp;
+	const char * json = nullptr;
+	const char * csv = nullptr;
+	const char * save = nullptr;
+	const char * label = "";
+	const char * against_base = nullptr;
+	const char * against = nullptr;
+	bool quick = false;
+	int rounds = 2;
+	for(int i = 1; i < argc; i++) {
+		const bool more = i + 1 < argc;
+		if(!strcmp(argv[i], "--filter") && more) {
+			opt.filter = argv[++i];
+		} else if(!strcmp(argv[i], "--samples") && more) {
+			opt.samples = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--quick")) {
+			opt.warmup_seconds = 0.01;
+			opt.sample_seconds = 0.001;
+			opt.samples = 10;
+			quick = true;
+		} else if(!strcmp(argv[i], "--json") && more) {
+			json = argv[++i];
+		} else if(!strcmp(argv[i], "--csv") && more) {
+			csv = argv[++i];
+		} else if(!strcmp(argv[i], "--save-baseline") && more) {
+			save = argv[++i];
+		} else if(!strcmp(argv[i], "--label") && more) {
+			label = argv[++i];
+		} else if(!strcmp(argv[i], "--compare") && more) {
+			against_base = argv[++i];
+		} else if(!strcmp(argv[i], "--against") && more) {
+			against = argv[++i];
+		} else if(!strcmp(argv[i], "--alpha") && more) {
+			cmp.alpha = atof(argv[++i]);
+		} else if(!strcmp(argv[i], "--min-change") && more) {
+			cmp.min_change = atof(argv[++i]);
+		} else if(!strcmp(argv[i], "--min-change-for") && more && strchr(argv[i + 1], '=')) {
+			const char * arg = argv[++i];
+			const char * eq = strchr(arg, '=');
+			cmp.min_change_for.push_back(std::make_pair(std::string(arg, eq), atof(eq + 1)));
+		} else if(!strcmp(argv[i], "--min-samples") && more) {
+			cmp.min_samples = (size_t)atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--confirm") && more) {
+			rounds = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--filter text] [--samples n] [--quick] [--json file] [--csv file]\n"
+				"       [--save-baseline file [--label text]]\n"
+				"       [--compare baseline [--against baseline] [--alpha p] [--min-change fraction]\n"
+				"        [--min-change-for prefix=fraction] [--min-samples n] [--confirm rounds]]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(opt.samples < 1) {
+		opt.samples = 1;
+	}
+
+	if(quick && against_base && !against) {
+		fprintf(stderr, "--quick takes too few samples to compare against a baseline; leave it off (or use --samples)\n");
+		return 2;
+	}
+	if(save && (size_t)opt.samples < cmp.min_samples) {
+		fprintf(stderr, "%d samples per benchmark is below the %d a comparison needs, so nothing could be judged "
+			"against this baseline; use more (or lower --min-samples)\n", opt.samples, (int)cmp.min_samples);
+		return 2;
+	}
+
+	bench::baseline before, after;
+	std::string error;
+	if(against_base && !bench::read_baseline(against_base, before, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if(against) {
+		if(!against_base) {
+			fprintf(stderr, "--against needs --compare\n");
+			return 2;
+		}
+		if(!bench::read_baseline(against, after, &error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	} else {
+		bench::runner r(opt);
+		run_all(r);
+		r.print(stdout);
+
+		if(json && !r.write_json(json)) {
+			fprintf(stderr, "couldn't write %s\n", json);
+			return 1;
+		}
+		if(csv && !r.write_csv(csv)) {
+			fprintf(stderr, "couldn't write %s\n", csv);
+			return 1;
+		}
+		if(save && !bench::write_baseline(save, label, r)) {
+			fprintf(stderr, "couldn't write %s\n", save);
+			return 1;
+		}
+		after = bench::make_baseline(label, r);
+	}
+
+	if(against_base) {
+		if(before.clock != after.clock) {
+			printf("\nnote: the baseline was timed with the %s clock, this with the %s clock\n", before.clock.c_str(), after.clock.c_str());
+		}
+		printf("\n%s -> %s\n", before.label.empty() ? against_base : before.label.c_str(),
+			after.label.empty() ? (against ? against : "this run") : after.label.c_str());
+		std::vector<bench::comparison> c = bench::compare(before, after, cmp);
+		if(!opt.filter.empty()) {
+			std::vector<bench::comparison> wanted;
+			for(const bench::comparison & x : c) {
+				if(x.name.find(opt.filter) != std::string::npos) {
+					wanted.push_back(x);
+				}
+			}
+			c.swap(wanted);
+		}
+		if(!against) {
+			confirm(c, before, opt, cmp, rounds);
+		}
+		const int slower = bench::print_comparison(stdout, c);
+		int once = 0, unjudged = 0;
+		for(const bench::comparison & x : c) {
+			if(x.result == bench::comparison::unconfirmed) {
+				once++;
+			} else if(x.result == bench::comparison::too_few || x.result == bench::comparison::removed) {
+				unjudged++;
+			}
+		}
+		if(slower) {
+			printf("%d regression%s\n", slower, slower == 1 ? "" : "s");
+		}
+		if(once) {
+			printf("%d benchmark%s slower once but not on rerun; too noisy to call, so not a pass either\n", once, once == 1 ? "" : "s");
+		}
+		if(unjudged) {
+			printf("%d benchmark%s couldn't be judged (too few samples, or missing from this run)\n", unjudged, unjudged == 1 ? "" : "s");
+		}
+		if(slower) {
+			return 3;
+		}
+		if(once || unjudged) {
+			return 4;
+		}
+	}
+	return 0;
+}
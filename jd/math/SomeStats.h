@@ -2,6 +2,8 @@
 
 #include <jd/math/basic.h>
 #include <vector>
+#include <algorithm>
+#include <memory>
 #include <limits>
 
 namespace jd {
@@ -53,15 +55,17 @@ struct SomeStats
 
 // IterT is a forward iterator type.
 // PredT retrieves the value of interest from each datum; it's a functor with float operator()( const IterT & i )
-template<typename StatsT, typename IterT, typename PredT>
-SomeStats<StatsT> CalcSomeStats( const IterT & begin, int count, PredT pred )
+// AllocT is a standard allocator for the sorted copy of the data, so callers on a hot path can hand it
+// scratch memory (e.g. jd::scratch_allocator inside a threadpool task) instead of the heap.
+template<typename StatsT, typename IterT, typename PredT, typename AllocT>
+SomeStats<StatsT> CalcSomeStats( const IterT & begin, int count, const AllocT & memAlloc, PredT pred )
 {
     SomeStats<StatsT> s;
     if( count <= 0 ) {
         return s;
     }
     
-    std::vector<StatsT> sorted(count);
+    std::vector<StatsT, AllocT> sorted(count, StatsT(0), memAlloc);
     
     int i = 0;
     for( IterT iter=begin; i < count; ++iter, ++i )
@@ -103,5 +107,11 @@ SomeStats<StatsT> CalcSomeStats( const IterT & begin, int count, PredT pred )
     return s;
 }
 
+template<typename StatsT, typename IterT, typename PredT>
+SomeStats<StatsT> CalcSomeStats( const IterT & begin, int count, PredT pred )
+{
+    return CalcSomeStats<StatsT>( begin, count, std::allocator<StatsT>(), pred );
+}
+
 
 }
@@ -283,9 +283,9 @@ namespace std
 {
 
 template <class T>
-struct less : binary_function<T, T, bool>
+struct less< jd::vec3<T> >
 {
-    bool operator()(const T& a, const T& b) const {
+    bool operator()(const jd::vec3<T>& a, const jd::vec3<T>& b) const {
         return ((a.x<b.x)? true :
                            ((a.y<b.y)? true :
                                        ((a.z<b.z)? true :
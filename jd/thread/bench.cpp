@@ -0,0 +1,541 @@
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include "threadpool.hpp"
+#include "parallel.hpp"
+#include "mpmc_queue.hpp"
+#include "parallel_sort.hpp"
+#include "scratch.hpp"
+
+#include <deque>
+#include <mutex>
+
+#include <jd/math/mat4x4.h>
+#include <jd/math/SomeStats.h>
+#include <jd/base/plat.h>
+#include <jd/base/Timing.h>     // link jd/base/Timing.cpp and jd/base/assert.cpp
+
+#if TARGET_OS_LINUX
+#include <time.h>
+#if TARGET_CPU_X86_64 || TARGET_CPU_i386
+#include <x86intrin.h>
+#endif
+#endif
+
+using namespace jd;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point t0) {
+	return std::chrono::duration<double>(bench_clock::now() - t0).count();
+}
+
+// a short, fixed amount of work per task, so queue overhead dominates
+static void spin_work(int n) {
+	volatile int x = 0;
+	for(int i = 0; i < n; i++) {
+		x = x + i;
+	}
+}
+
+// fork from the outside, then fan out from inside the workers, which is the case the local deques are for
+static double bench_throughput(schedule_policy policy, queue_impl queue, int threads, int outer, int inner,
+                               bool stats = false) {
+	threadpool_options opt;
+	opt.threads = threads;
+	opt.policy = policy;
+	opt.queue = queue;
+	opt.collect_stats = stats;
+	threadpool tp(opt);
+
+	std::atomic<int> done(0);
+	std::function<void()> leaf = [&]{ spin_work(200); done++; };
+	std::function<void()> root = [&]{
+		for(int i = 0; i < inner; i++) {
+			tp.add_task(leaf);
+		}
+	};
+	auto t0 = bench_clock::now();
+	for(int i = 0; i < outer; i++) {
+		tp.add_task(root);
+	}
+	while(done.load() < outer * inner) {
+		std::this_thread::yield();
+	}
+	return (outer * inner) / seconds_since(t0);
+}
+
+static void bench_scaling() {
+	const int max_threads = (int)std::thread::hardware_concurrency();
+	printf("threadpool throughput, tasks/sec (%d hardware threads)\n", max_threads);
+	printf("%8s %16s %20s %16s\n", "threads", "shared_queue", "shared (lock_free)", "work_stealing");
+	for(int n = 1; n <= max_threads; n *= 2) {
+		double shared = bench_throughput(schedule_policy::shared_queue, queue_impl::locked, n, 64, 4096);
+		double lock_free = bench_throughput(schedule_policy::shared_queue, queue_impl::lock_free, n, 64, 4096);
+		double stealing = bench_throughput(schedule_policy::work_stealing, queue_impl::locked, n, 64, 4096);
+		printf("%8d %16.0f %20.0f %16.0f\n", n, shared, lock_free, stealing);
+		if(n < max_threads && n * 2 > max_threads) {
+			n = max_threads / 2;
+		}
+	}
+}
+
+// what collect_stats costs on tiny tasks, where it's the largest share of the work
+static void bench_stats_overhead() {
+	const int threads = (int)std::thread::hardware_concurrency();
+	printf("\ncollect_stats overhead, tasks/sec on %d workers\n", threads);
+	printf("%-16s %16s %16s\n", "policy", "stats off", "stats on");
+	double off = bench_throughput(schedule_policy::shared_queue, queue_impl::locked, threads, 64, 4096, false);
+	double on = bench_throughput(schedule_policy::shared_queue, queue_impl::locked, threads, 64, 4096, true);
+	printf("%-16s %16.0f %16.0f\n", "shared_queue", off, on);
+	off = bench_throughput(schedule_policy::work_stealing, queue_impl::locked, threads, 64, 4096, false);
+	on = bench_throughput(schedule_policy::work_stealing, queue_impl::locked, threads, 64, 4096, true);
+	printf("%-16s %16.0f %16.0f\n", "work_stealing", off, on);
+}
+
+// per-task cost of queueing 10k tiny tasks one add_task at a time vs one add_tasks, submit side only,
+// with the workers parked so every single submit has someone to wake
+static void bench_bulk_submit(const char * name, queue_impl queue) {
+	const int n = 10000, rounds = 20;
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.idle_spin = 0;
+	opt.idle_yield = 0;
+	opt.queue = queue;
+	threadpool tp(opt);
+	std::atomic<int> done(0);
+	std::vector<task> batch(n);
+	double single = 0, bulk = 0;
+	for(int r = 0; r < rounds; r++) {
+		for(auto & t : batch) {
+			t = task([&done]{ done++; });
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		auto t0 = bench_clock::now();
+		for(auto & t : batch) {
+			tp.add_task(std::move(t));
+		}
+		single += seconds_since(t0);
+		while(done.load() < (2 * r + 1) * n) {
+			tp.run_one();
+		}
+
+		for(auto & t : batch) {
+			t = task([&done]{ done++; });
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		t0 = bench_clock::now();
+		tp.add_tasks(batch);
+		bulk += seconds_since(t0);
+		while(done.load() < (2 * r + 2) * n) {
+			tp.run_one();
+		}
+	}
+	printf("%-20s %14.1f %14.1f\n", name, single / (rounds * n) * 1e9, bulk / (rounds * n) * 1e9);
+}
+
+// std::sort against parallel_sort / parallel_radix_sort on n random floats, and a serial prefix sum against
+// parallel_inclusive_scan, all on a pool with one worker per hardware thread (the caller makes one more)
+static void bench_sort(long n) {
+	unsigned hw = std::thread::hardware_concurrency();
+	threadpool tp(hw > 1 ? (int)hw - 1 : 0);
+	std::vector<float> input(n), v(n), sums(n);
+	uint32_t seed = 1;
+	for(long i = 0; i < n; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		input[i] = (float)(seed >> 8) * (1.0f / 16777216.0f) - 0.5f;
+	}
+
+	v = input;
+	auto t0 = bench_clock::now();
+	std::sort(v.begin(), v.end());
+	const double serial = seconds_since(t0);
+
+	v = input;
+	t0 = bench_clock::now();
+	parallel_sort(tp, v.begin(), v.end());
+	const double merge = seconds_since(t0);
+
+	v = input;
+	t0 = bench_clock::now();
+	parallel_radix_sort(tp, &v[0], &v[0] + n);
+	const double radix = seconds_since(t0);
+
+	t0 = bench_clock::now();
+	std::partial_sum(input.begin(), input.end(), sums.begin());
+	const double scan = seconds_since(t0);
+
+	t0 = bench_clock::now();
+	parallel_inclusive_scan(tp, input.begin(), input.end(), sums.begin(), 1L << 18);
+	const double pscan = seconds_since(t0);
+
+	printf("%10ld %12.1f %12.1f %12.1f %12.2f %12.2f\n", n, serial * 1e3, merge * 1e3, radix * 1e3, scan * 1e3, pscan * 1e3);
+}
+
+// timer insert/cancel with `pending` timers already waiting, on the bare heap and through the pool (which adds a lock)
+static void bench_timers(int pending) {
+	std::vector<double> when(pending);
+	unsigned x = 12345;
+	for(int i = 0; i < pending; i++) {
+		x = x * 1664525u + 1013904223u;
+		when[i] = 1000.0 + (x >> 8) * 1e-6;
+	}
+	const int ops = 100000;
+
+	timer_heap<task> heap;
+	for(int i = 0; i < pending; i++) {
+		heap.insert(when[i], task([]{}));
+	}
+	std::vector<timer_heap<task>::id> ids(ops);
+	auto t0 = bench_clock::now();
+	for(int i = 0; i < ops; i++) {
+		ids[i] = heap.insert(when[i % pending] + 0.5, task([]{}));
+	}
+	const double insert = seconds_since(t0) / ops;
+	t0 = bench_clock::now();
+	for(int i = 0; i < ops; i++) {
+		heap.cancel(ids[i]);
+	}
+	const double cancel = seconds_since(t0) / ops;
+
+	threadpool tp(1);
+	const double base = tp.now() + 3600.0;  // far enough out that nothing fires
+	for(int i = 0; i < pending; i++) {
+		tp.add_task_at(base + when[i], []{});
+	}
+	std::vector<timer_id> pool_ids(ops);
+	t0 = bench_clock::now();
+	for(int i = 0; i < ops; i++) {
+		pool_ids[i] = tp.add_task_at(base + when[i % pending] + 0.5, []{});
+	}
+	const double pool_insert = seconds_since(t0) / ops;
+	t0 = bench_clock::now();
+	for(int i = 0; i < ops; i++) {
+		tp.cancel_timer(pool_ids[i]);
+	}
+	const double pool_cancel = seconds_since(t0) / ops;
+
+	printf("%10d %14.1f %14.1f %14.1f %14.1f\n", pending, insert * 1e9, cancel * 1e9, pool_insert * 1e9, pool_cancel * 1e9);
+}
+
+// submit-to-start latency: tasks trickle in with a gap between them, so workers have gone idle
+// and the number includes however long the idle policy takes to notice
+static void bench_latency(const char * name, int idle_spin, int idle_yield, double gap_seconds) {
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.idle_spin = idle_spin;
+	opt.idle_yield = idle_yield;
+	threadpool tp(opt);
+
+	const int samples = 2000;
+	std::vector<double> latency;
+	latency.reserve(samples);
+	for(int i = 0; i < samples; i++) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(gap_seconds));
+		std::atomic<bool> ran(false);
+		bench_clock::time_point submitted = bench_clock::now();
+		double started = 0;
+		std::function<void()> f = [&]{
+			started = seconds_since(submitted);
+			ran.store(true, std::memory_order_release);
+		};
+		tp.add_task(f);
+		while(!ran.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+		latency.push_back(started);
+	}
+	std::sort(latency.begin(), latency.end());
+	printf("%-24s gap %6.0fus   p50 %8.2fus   p99 %8.2fus\n", name, gap_seconds * 1e6,
+		latency[samples / 2] * 1e6, latency[(samples * 99) / 100] * 1e6);
+}
+
+struct float_value {
+	inline float operator()( const float * f ) const { return *f; }
+};
+
+static volatile double clock_sink;     // keeps the clock reads from being optimized away
+
+// cost of one timestamp from each clock we could stamp tasks with, ns per call
+template<typename F>
+static void bench_clock_source(const char * name, const F & read) {
+	const int n = 2000000;
+	double sink = 0;
+	auto t0 = bench_clock::now();
+	for(int i = 0; i < n; i++) {
+		sink += (double)read();
+	}
+	const double per = seconds_since(t0) / n;
+	clock_sink = sink;
+	printf("%-36s %10.1f\n", name, per * 1e9);
+}
+
+static void bench_clock_sources() {
+	printf("\nclock cost, ns per call\n");
+	bench_clock_source("std::chrono::steady_clock::now", []{ return bench_clock::now().time_since_epoch().count(); });
+	bench_clock_source("stat_now", []{ return stat_now(); });
+#if TARGET_OS_LINUX
+	bench_clock_source("clock_gettime(CLOCK_MONOTONIC)", []{
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return t.tv_nsec;
+	});
+	bench_clock_source("clock_gettime(CLOCK_MONOTONIC_RAW)", []{
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+		return t.tv_nsec;
+	});
+#if TARGET_CPU_X86_64 || TARGET_CPU_i386
+	bench_clock_source("rdtsc", []{ return __rdtsc(); });
+#endif
+#endif
+	// before TimeSystemInit() it's always the OS clock
+	bench_clock_source("GetTimeSampleSeconds (os clock)", []{ return GetTimeSampleSeconds(); });
+	bench_clock_source("GetTimeTicks (os clock)", []{ return GetTimeTicks(); });
+	TimeSystemInit();
+	if(TimeSystemUsesTSC()) {
+		bench_clock_source("GetTimeSampleSeconds (tsc)", []{ return GetTimeSampleSeconds(); });
+		bench_clock_source("GetTimeTicks (tsc)", []{ return GetTimeTicks(); });
+	} else {
+		printf("%-36s %10s\n", "GetTimeSampleSeconds (tsc)", "n/a");
+		printf("%-36s %10s\n", "GetTimeTicks (tsc)", "n/a");
+	}
+}
+
+// 1M points through mat_mulPoint, and CalcSomeStats over 1M samples in 1000-sample series,
+// serial vs. parallel_for with each partitioner; CalcSomeStats again with its sort buffer on this_worker::scratch()
+static void bench_math_kernels() {
+	const int n = 1 << 20;
+	const int series = 1024;
+	const int threads = (int)std::thread::hardware_concurrency();
+
+	mat4x4f M;
+	mat_fromPosRot(M, vec3f(1, 2, 3), quat<float>(0, 0, 0, 1));
+	std::vector<vec3f> points(n), out(n);
+	std::vector<float> samples(n);
+	for(int i = 0; i < n; i++) {
+		points[i] = vec3f((float)i, (float)(i & 255), 1.0f);
+		samples[i] = (float)(((unsigned)i * 7919u) % 1000u);
+	}
+	std::vector<SomeStats<float>> stats(n / series);
+
+	auto transform = [&](int i){ out[i] = mat_mulPoint(M, points[i]); };
+	auto series_stats = [&](int s){
+		stats[s] = CalcSomeStats<float>(&samples[s * series], series, float_value());
+	};
+	auto series_stats_scratch = [&](int s){
+		scratch_scope scope;
+		stats[s] = CalcSomeStats<float>(&samples[s * series], series, scratch_allocator<float>(), float_value());
+	};
+
+	threadpool_options opt;
+	opt.threads = threads;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool tp(opt);
+
+	printf("\nparallel_for on %d workers + caller, 1M elements\n", threads);
+	printf("%-16s %12s %14s %12s\n", "kernel", "serial ms", "static ms", "adaptive ms");
+
+	// warm up caches and the pool before timing anything
+	parallel_for(tp, 0, n, 16384, transform);
+
+	bench_clock::time_point t0 = bench_clock::now();
+	for(int i = 0; i < n; i++) {
+		transform(i);
+	}
+	double serial = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n, 16384, transform, partitioner::static_chunks);
+	double stat = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n, 16384, transform, partitioner::adaptive);
+	double adaptive = seconds_since(t0);
+	printf("%-16s %12.2f %14.2f %12.2f\n", "mat_mulPoint", serial * 1e3, stat * 1e3, adaptive * 1e3);
+
+	t0 = bench_clock::now();
+	for(int s = 0; s < n / series; s++) {
+		series_stats(s);
+	}
+	serial = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n / series, 8, series_stats, partitioner::static_chunks);
+	stat = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n / series, 8, series_stats, partitioner::adaptive);
+	adaptive = seconds_since(t0);
+	printf("%-16s %12.2f %14.2f %12.2f\n", "CalcSomeStats", serial * 1e3, stat * 1e3, adaptive * 1e3);
+
+	t0 = bench_clock::now();
+	for(int s = 0; s < n / series; s++) {
+		series_stats_scratch(s);
+	}
+	serial = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n / series, 8, series_stats_scratch, partitioner::static_chunks);
+	stat = seconds_since(t0);
+	t0 = bench_clock::now();
+	parallel_for(tp, 0, n / series, 8, series_stats_scratch, partitioner::adaptive);
+	adaptive = seconds_since(t0);
+	printf("%-16s %12.2f %14.2f %12.2f\n", "  with scratch", serial * 1e3, stat * 1e3, adaptive * 1e3);
+}
+
+// the mutex + std::deque the pool used to have, as the baseline for mpmc_queue
+template<typename T>
+class locked_deque {
+	std::mutex access;
+	std::deque<T> items;
+public:
+	bool try_push(T && v) {
+		std::lock_guard<std::mutex> lock(access);
+		items.push_back(std::move(v));
+		return true;
+	}
+	bool try_pop(T & out) {
+		std::lock_guard<std::mutex> lock(access);
+		if(items.empty()) {
+			return false;
+		}
+		out = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+};
+
+static void backoff(int spins) {
+	if(spins < 64) {
+		cpu_relax();
+	} else {
+		std::this_thread::yield();
+	}
+}
+
+// producers each push items_per_producer ints while `consumers` threads drain them; returns items/sec
+template<typename Queue>
+static double bench_queue_contention(Queue & q, int producers, int consumers, int items_per_producer) {
+	std::atomic<int> consumed(0);
+	std::atomic<bool> go(false);
+	const int total = producers * items_per_producer;
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; p++) {
+		threads.push_back(std::thread([&]{
+			while(!go.load()) {
+				std::this_thread::yield();
+			}
+			for(int i = 0; i < items_per_producer; i++) {
+				int v = i;
+				for(int spins = 0; !q.try_push(std::move(v)); spins++) {
+					backoff(spins);
+				}
+			}
+		}));
+	}
+	for(int c = 0; c < consumers; c++) {
+		threads.push_back(std::thread([&]{
+			while(!go.load()) {
+				std::this_thread::yield();
+			}
+			int v;
+			int spins = 0;
+			while(consumed.load(std::memory_order_relaxed) < total) {
+				if(q.try_pop(v)) {
+					consumed.fetch_add(1, std::memory_order_relaxed);
+					spins = 0;
+				} else {
+					backoff(spins++);
+				}
+			}
+		}));
+	}
+	auto t0 = bench_clock::now();
+	go = true;
+	for(auto & t : threads) {
+		t.join();
+	}
+	return total / seconds_since(t0);
+}
+
+static void bench_queues() {
+	printf("\nqueue contention, items/sec with 2 consumers\n");
+	printf("%10s %16s %16s\n", "producers", "mutex+deque", "mpmc_queue");
+	const int producer_counts[] = { 1, 2, 4, 8, 16 };
+	for(int producers : producer_counts) {
+		const int per_producer = 400000 / producers;
+		locked_deque<int> locked;
+		mpmc_queue<int> lock_free(4096);
+		double a = bench_queue_contention(locked, producers, 2, per_producer);
+		double b = bench_queue_contention(lock_free, producers, 2, per_producer);
+		printf("%10d %16.0f %16.0f\n", producers, a, b);
+	}
+}
+
+// latency of a few urgent tasks while the pool is buried in background work
+static void bench_priority(const char * name, task_priority flood_pri, task_priority probe_pri, int reserved) {
+	threadpool_options opt;
+	opt.threads = 4;
+	opt.reserved_critical_workers = reserved;
+	threadpool tp(opt);
+
+	const int flood = 20000;
+	std::atomic<int> flood_done(0);
+	for(int i = 0; i < flood; i++) {
+		tp.add_task(flood_pri, task([&]{ spin_work(5000); flood_done++; }));
+	}
+
+	const int probes = 300;
+	std::vector<double> latency(probes);
+	std::vector<std::future<void>> futs;
+	for(int i = 0; i < probes; i++) {
+		bench_clock::time_point submitted = bench_clock::now();
+		double * out = &latency[i];
+		futs.push_back(tp.add_task(probe_pri, [submitted, out]{ *out = seconds_since(submitted); }));
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	for(auto & f : futs) {
+		f.get();
+	}
+	std::sort(latency.begin(), latency.end());
+	printf("%-36s p50 %10.1fus   p99 %10.1fus\n", name, latency[probes / 2] * 1e6, latency[(probes * 99) / 100] * 1e6);
+	while(flood_done.load() < flood) {
+		tp.run_one();
+	}
+}
+
+int main() {
+	bench_clock_sources();
+	bench_scaling();
+	bench_math_kernels();
+	bench_queues();
+	bench_stats_overhead();
+
+	printf("\nsubmit cost, ns per task, batches of 10k into 2 parked workers\n");
+	printf("%-20s %14s %14s\n", "queue", "add_task", "add_tasks");
+	bench_bulk_submit("locked", queue_impl::locked);
+	bench_bulk_submit("lock_free", queue_impl::lock_free);
+
+	printf("\ntimer cost, ns per op, 100k inserts then 100k cancels on top of the pending ones\n");
+	printf("%10s %14s %14s %14s %14s\n", "pending", "heap insert", "heap cancel", "pool insert", "pool cancel");
+	bench_timers(1000);
+	bench_timers(100000);
+
+	printf("\nsorting and scanning random floats, ms, %u hardware threads\n", std::thread::hardware_concurrency());
+	printf("%10s %12s %12s %12s %12s %12s\n", "n", "std::sort", "parallel", "radix", "partial_sum", "scan");
+	bench_sort(1000000);
+	bench_sort(10000000);
+	bench_sort(100000000);
+
+	printf("\nurgent-task latency under a background flood, 4 workers\n");
+	bench_priority("everything normal (FIFO)", task_priority::normal, task_priority::normal, 0);
+	bench_priority("critical lane", task_priority::background, task_priority::critical, 0);
+	bench_priority("critical lane + 1 reserved worker", task_priority::background, task_priority::critical, 1);
+
+	printf("\nthreadpool submit-to-start latency\n");
+	const double gaps[] = { 0.0, 0.0001, 0.001 };
+	for(double gap : gaps) {
+		bench_latency("park immediately", 0, 0, gap);
+		bench_latency("spin 2000, yield 16", 2000, 16, gap);
+		bench_latency("spin 100000", 100000, 16, gap);
+	}
+}
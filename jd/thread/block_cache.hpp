@@ -0,0 +1,107 @@
+#pragma once
+
+#include <new>
+#include <mutex>
+#include <memory>
+#include <cstddef>
+
+namespace jd {
+
+// block_cache -- recycles small, fixed-size heap blocks.
+// A threadpool keeps one for the shared state behind the futures it hands out: the state is allocated
+// by the submitting thread and usually freed by whoever reads the future, so a thread-local list would
+// drain on one side and pile up on the other.  One short lock keeps it balanced.
+// Requests bigger than block_size go straight to the heap.
+class block_cache {
+	struct node {
+		node * next;
+	};
+
+	std::mutex access;
+	node * free_list;
+	size_t free_count;
+
+public:
+	static const size_t block_size = 128;
+	static const size_t max_free = 4096;    // beyond this, freed blocks go back to the heap
+
+	block_cache() : free_list(nullptr), free_count(0) {}
+	~block_cache() {
+		while(free_list) {
+			node * n = free_list;
+			free_list = n->next;
+			::operator delete(n);
+		}
+	}
+
+	block_cache(const block_cache&) = delete;
+	block_cache& operator=(const block_cache&) = delete;
+
+	void * allocate(size_t bytes) {
+		if(bytes > block_size) {
+			return ::operator new(bytes);
+		}
+		{
+			std::lock_guard<std::mutex> lock(access);
+			if(free_list) {
+				node * n = free_list;
+				free_list = n->next;
+				--free_count;
+				return n;
+			}
+		}
+		return ::operator new(block_size);
+	}
+
+	void deallocate(void * p, size_t bytes) {
+		if(bytes <= block_size) {
+			std::lock_guard<std::mutex> lock(access);
+			if(free_count < max_free) {
+				node * n = static_cast<node*>(p);
+				n->next = free_list;
+				free_list = n;
+				++free_count;
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+};
+
+// cache_allocator -- a standard allocator on top of a shared block_cache.
+// Copies share the cache, and anything allocated through it keeps the cache alive,
+// so a future can safely outlive the pool that created it.
+template<typename T>
+class cache_allocator {
+public:
+	typedef T value_type;
+
+	explicit cache_allocator(const std::shared_ptr<block_cache> & c) : cache(c) {}
+	template<typename U>
+	cache_allocator(const cache_allocator<U> & other) : cache(other.cache) {}
+
+	T * allocate(size_t n) {
+		if(alignof(T) > alignof(std::max_align_t)) {
+			return std::allocator<T>().allocate(n);
+		}
+		return static_cast<T*>(cache->allocate(n * sizeof(T)));
+	}
+	void deallocate(T * p, size_t n) {
+		if(alignof(T) > alignof(std::max_align_t)) {
+			std::allocator<T>().deallocate(p, n);
+			return;
+		}
+		cache->deallocate(p, n * sizeof(T));
+	}
+
+	template<typename U>
+	bool operator==(const cache_allocator<U> & other) const { return cache == other.cache; }
+	template<typename U>
+	bool operator!=(const cache_allocator<U> & other) const { return cache != other.cache; }
+
+private:
+	template<typename U> friend class cache_allocator;
+	std::shared_ptr<block_cache> cache;
+};
+
+}
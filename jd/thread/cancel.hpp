@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <exception>
+
+namespace jd {
+
+// What a future holds when its task was cancelled, or its deadline passed, before it started:
+// get() throws this.
+struct task_cancelled : std::exception {
+	const char * what() const noexcept override { return "jd::task_cancelled"; }
+};
+
+namespace detail {
+
+struct cancel_state {
+	std::atomic<bool> cancelled;
+	cancel_state() : cancelled(false) {}
+};
+
+} // namespace detail
+
+// cancel_token -- the read side of a cancel_source.  Cheap to copy and to check (one atomic load).
+// A default-constructed token is never cancelled.
+class cancel_token {
+	std::shared_ptr<const detail::cancel_state> state;
+	friend class cancel_source;
+	friend struct task_context;
+
+public:
+	cancel_token() {}
+
+	bool is_cancelled() const { return state && state->cancelled.load(std::memory_order_acquire); }
+	bool can_be_cancelled() const { return (bool)state; }
+};
+
+// cancel_source -- flips every token made from it to cancelled.  Tasks that haven't started yet
+// are dropped when a worker reaches them; running tasks see it through their token or this_task::cancelled().
+//
+// EXAMPLE: drop the culls for a frame we've given up on
+//   jd::cancel_source frame;
+//   jd::task_options o;
+//   o.token = frame.token();
+//   for(auto & chunk : chunks) pool.add_task(o, [&chunk]{ Cull(chunk); });
+//   ...
+//   frame.cancel();
+class cancel_source {
+	std::shared_ptr<detail::cancel_state> state;
+
+public:
+	cancel_source() : state(std::make_shared<detail::cancel_state>()) {}
+
+	void cancel() { state->cancelled.store(true, std::memory_order_release); }
+	bool is_cancelled() const { return state->cancelled.load(std::memory_order_acquire); }
+
+	cancel_token token() const {
+		cancel_token t;
+		t.state = state;
+		return t;
+	}
+};
+
+// What a cancellable task runs under: its token, and a deadline on the pool's timer clock.
+struct task_context {
+	const detail::cancel_state * state = nullptr;
+	double deadline = std::numeric_limits<double>::infinity();
+	double (*clock)() = nullptr;
+
+	task_context() {}
+	task_context(const cancel_token & token, double d, double (*c)()) : state(token.state.get()), deadline(d), clock(c) {}
+
+	bool has_deadline() const { return deadline != std::numeric_limits<double>::infinity(); }
+
+	bool cancelled() const {
+		return (state && state->cancelled.load(std::memory_order_acquire))
+			|| (has_deadline() && clock() >= deadline);
+	}
+};
+
+namespace detail {
+
+inline const task_context *& current_task_context() {
+	static thread_local const task_context * ctx = nullptr;
+	return ctx;
+}
+
+// installs a context for the length of a task, restoring the outer one (a helping wait can nest tasks)
+struct task_context_scope {
+	const task_context * outer;
+	explicit task_context_scope(const task_context & c) : outer(current_task_context()) { current_task_context() = &c; }
+	~task_context_scope() { current_task_context() = outer; }
+};
+
+} // namespace detail
+
+namespace this_task {
+
+// True if the task running on this thread was added with a token that's since been cancelled,
+// or with a deadline that has passed.  Long tasks should check it between steps and bail out.
+// The token check is one atomic load; a deadline adds a clock read.
+inline bool cancelled() {
+	const task_context * c = detail::current_task_context();
+	return c && c->cancelled();
+}
+
+}
+
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <jd/thread/threadpool.hpp>
+
+#if JD_THREAD_COROUTINES
+
+#include <coroutine>
+#include <optional>
+#include <variant>
+#include <vector>
+#include <tuple>
+#include <atomic>
+#include <exception>
+#include <utility>
+
+namespace jd {
+namespace coro {
+
+// Coroutines on top of jd::threadpool.
+// jd::coro::task<T> is a lazy coroutine: it starts when it's first co_awaited, and resumes its awaiter
+// when it finishes, on whichever thread finished it.  Nothing blocks a worker: a coroutine that
+// waits on another just suspends, and the worker goes back to the pool's queues.
+//
+// EXAMPLE:
+//   coro::task<float> Simulate( threadpool & pool, Body & b ) {
+//       co_await pool.schedule();         // now running on a worker
+//       co_return Integrate( b );
+//   }
+//   coro::task<void> Frame( threadpool & pool, std::vector<Body> & bodies ) {
+//       std::vector<coro::task<float>> steps;
+//       for( Body & b : bodies ) { steps.push_back( Simulate( pool, b ) ); }
+//       std::vector<float> energy = co_await coro::when_all( std::move(steps) );
+//       ...
+//   }
+//   coro::sync_wait( pool, Frame( pool, bodies ) );   // from a thread that isn't a coroutine
+
+template<typename T = void>
+class task;
+
+namespace detail {
+
+struct final_awaiter {
+	bool await_ready() const noexcept { return false; }
+	template<typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+		std::coroutine_handle<> c = h.promise().continuation;
+		return c ? c : std::noop_coroutine();
+	}
+	void await_resume() const noexcept {}
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template<typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+	template<typename U>
+	void return_value(U && v) { value.emplace(std::forward<U>(v)); }
+	T result() {
+		if(error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+};
+
+template<>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+	void result() {
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+} // namespace detail
+
+template<typename T>
+class [[nodiscard]] task {
+public:
+	typedef detail::promise<T> promise_type;
+
+	task() noexcept : h(nullptr) {}
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept : h(handle) {}
+	task(task && other) noexcept : h(std::exchange(other.h, nullptr)) {}
+	task & operator=(task && other) noexcept {
+		if(this != &other) {
+			if(h) {
+				h.destroy();
+			}
+			h = std::exchange(other.h, nullptr);
+		}
+		return *this;
+	}
+	task(const task&) = delete;
+	task & operator=(const task&) = delete;
+	~task() {
+		if(h) {
+			h.destroy();
+		}
+	}
+
+	bool done() const { return !h || h.done(); }
+
+	// start the coroutine (if it hasn't finished), and resume the awaiter with its result
+	auto operator co_await() noexcept {
+		struct awaiter {
+			std::coroutine_handle<promise_type> h;
+
+			bool await_ready() const noexcept { return h.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+				h.promise().continuation = awaiting;
+				return h;
+			}
+			T await_resume() { return h.promise().result(); }
+		};
+		return awaiter{ h };
+	}
+
+private:
+	std::coroutine_handle<promise_type> h;
+};
+
+namespace detail {
+
+template<typename T>
+inline task<T> promise<T>::get_return_object() noexcept {
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept {
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// when_all and sync_wait run each awaited task inside a small driver coroutine, which reports
+// to a latch when it's done.  The latch starts at n+1; the extra count belongs to the waiter,
+// so children that finish before the waiter has suspended can't resume it early.
+struct latch {
+	explicit latch(size_t n) : count(n + 1) {}
+
+	std::atomic<size_t> count;
+	std::coroutine_handle<> waiter;
+
+	// returns false if everything already finished, so the waiter shouldn't suspend
+	bool arrive_and_suspend() { return count.fetch_sub(1, std::memory_order_acq_rel) > 1; }
+
+	std::coroutine_handle<> arrive() {
+		if(count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			return waiter;
+		}
+		return std::noop_coroutine();
+	}
+};
+
+class driver {
+public:
+	struct promise_type {
+		latch * l = nullptr;
+
+		driver get_return_object() noexcept { return driver(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+		auto final_suspend() const noexcept {
+			struct awaiter {
+				bool await_ready() const noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+					return h.promise().l->arrive();
+				}
+				void await_resume() const noexcept {}
+			};
+			return awaiter{};
+		}
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }   // driver bodies catch everything
+	};
+
+	explicit driver(std::coroutine_handle<promise_type> handle) : h(handle) {}
+	driver(driver && other) noexcept : h(std::exchange(other.h, nullptr)) {}
+	driver(const driver&) = delete;
+	~driver() {
+		if(h) {
+			h.destroy();
+		}
+	}
+
+	void start(latch & l) {
+		h.promise().l = &l;
+		h.resume();
+	}
+
+private:
+	std::coroutine_handle<promise_type> h;
+};
+
+template<typename T>
+driver drive(task<T> & t, std::optional<T> & out, std::exception_ptr & error) {
+	try {
+		out.emplace(co_await t);
+	} catch(...) {
+		error = std::current_exception();
+	}
+}
+
+inline driver drive(task<void> & t, std::exception_ptr & error) {
+	try {
+		co_await t;
+	} catch(...) {
+		error = std::current_exception();
+	}
+}
+
+// co_await this to start every driver and wait for all of them
+struct start_all {
+	latch & l;
+	std::vector<driver> & drivers;
+
+	bool await_ready() const noexcept { return drivers.empty(); }
+	bool await_suspend(std::coroutine_handle<> h) {
+		l.waiter = h;
+		for(driver & d : drivers) {
+			d.start(l);
+		}
+		return l.arrive_and_suspend();
+	}
+	void await_resume() const noexcept {}
+};
+
+template<typename T>
+struct void_to_monostate { typedef T type; };
+template<>
+struct void_to_monostate<void> { typedef std::monostate type; };
+
+} // namespace detail
+
+// when_all: run every task and resume with all of their results, in order.
+// Children run concurrently if they co_await pool.schedule(); otherwise they run one after another
+// on the awaiting thread until they first suspend.  If any task threw, the first exception is rethrown.
+template<typename T>
+task<std::vector<T>> when_all(std::vector<task<T>> tasks) {
+	std::vector<std::optional<T>> results(tasks.size());
+	std::vector<std::exception_ptr> errors(tasks.size());
+	std::vector<detail::driver> drivers;
+	drivers.reserve(tasks.size());
+	for(size_t i = 0; i < tasks.size(); i++) {
+		drivers.push_back(detail::drive(tasks[i], results[i], errors[i]));
+	}
+	detail::latch l(drivers.size());
+	co_await detail::start_all{ l, drivers };
+
+	for(std::exception_ptr & e : errors) {
+		if(e) {
+			std::rethrow_exception(e);
+		}
+	}
+	std::vector<T> out;
+	out.reserve(results.size());
+	for(std::optional<T> & r : results) {
+		out.push_back(std::move(*r));
+	}
+	co_return out;
+}
+
+inline task<void> when_all(std::vector<task<void>> tasks) {
+	std::vector<std::exception_ptr> errors(tasks.size());
+	std::vector<detail::driver> drivers;
+	drivers.reserve(tasks.size());
+	for(size_t i = 0; i < tasks.size(); i++) {
+		drivers.push_back(detail::drive(tasks[i], errors[i]));
+	}
+	detail::latch l(drivers.size());
+	co_await detail::start_all{ l, drivers };
+
+	for(std::exception_ptr & e : errors) {
+		if(e) {
+			std::rethrow_exception(e);
+		}
+	}
+}
+
+namespace detail {
+
+template<typename T>
+driver drive_into(task<T> & t, std::optional<typename void_to_monostate<T>::type> & out, std::exception_ptr & error) {
+	return drive(t, out, error);
+}
+
+inline driver drive_into(task<void> & t, std::optional<std::monostate> & out, std::exception_ptr & error) {
+	out.emplace();
+	return drive(t, error);
+}
+
+template<typename... Ts, size_t... I>
+task<std::tuple<typename void_to_monostate<Ts>::type...>> when_all_tuple(std::tuple<task<Ts>...> tasks, std::index_sequence<I...>) {
+	std::tuple<std::optional<typename void_to_monostate<Ts>::type>...> results;
+	std::exception_ptr errors[sizeof...(Ts)];
+	std::vector<driver> drivers;
+	drivers.reserve(sizeof...(Ts));
+	(drivers.push_back(drive_into(std::get<I>(tasks), std::get<I>(results), errors[I])), ...);
+	latch l(drivers.size());
+	co_await start_all{ l, drivers };
+
+	for(std::exception_ptr & e : errors) {
+		if(e) {
+			std::rethrow_exception(e);
+		}
+	}
+	co_return std::tuple<typename void_to_monostate<Ts>::type...>(std::move(*std::get<I>(results))...);
+}
+
+} // namespace detail
+
+// when_all over differently-typed tasks: resumes with a tuple of results (std::monostate for task<void>)
+template<typename... Ts>
+task<std::tuple<typename detail::void_to_monostate<Ts>::type...>> when_all(task<Ts>... tasks) {
+	return detail::when_all_tuple(std::tuple<task<Ts>...>(std::move(tasks)...), std::index_sequence_for<Ts...>());
+}
+
+// sync_wait: run t to completion from ordinary (non-coroutine) code and return its result.
+// While it waits, the calling thread runs queued pool tasks, so it's safe to call with a one-thread pool
+// or from inside a worker.
+template<typename T>
+T sync_wait(threadpool & pool, task<T> t) {
+	std::optional<typename detail::void_to_monostate<T>::type> result;
+	std::exception_ptr error;
+	std::vector<detail::driver> drivers;
+	drivers.push_back(detail::drive_into(t, result, error));
+	detail::latch l(1);
+	drivers[0].start(l);
+	pool.help_until([&l]{ return l.count.load(std::memory_order_acquire) <= 1; });
+	if(error) {
+		std::rethrow_exception(error);
+	}
+	if constexpr(!std::is_void<T>::value) {
+		return std::move(*result);
+	}
+}
+
+} // namespace coro
+} // namespace jd
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <jd/thread/threadpool.hpp>
+
+#include <future>
+#include <chrono>
+#include <utility>
+
+namespace jd {
+
+// wait_and_help: wait for f to become ready, running the pool's queued tasks on this thread meanwhile.
+// Use it instead of f.wait() inside a pool task: a blocked worker is lost capacity, and if every worker
+// blocks on work that's still queued behind them, the pool deadlocks.
+// The tasks run while helping can be anything in the queue, so the wait can last as long as the longest
+// of them, and nesting helps builds up stack the way recursion does.
+template<typename T>
+void wait_and_help(threadpool & pool, const std::future<T> & f) {
+	pool.help_until([&f]{ return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+}
+
+// future -- a std::future that remembers its pool, and helps it instead of blocking in wait() and get().
+//
+// EXAMPLE: fork-join from inside a task, safe even on a one-thread pool
+//   int Fib( threadpool & pool, int n ) {
+//       if( n < 2 ) return n;
+//       jd::future<int> a = spawn( pool, [&pool,n]{ return Fib( pool, n-1 ); } );
+//       int b = Fib( pool, n-2 );
+//       return a.get() + b;
+//   }
+template<typename T>
+class future {
+	threadpool * pool;
+	std::future<T> f;
+
+public:
+	future() : pool(nullptr) {}
+	future(threadpool & p, std::future<T> && fut) : pool(&p), f(std::move(fut)) {}
+
+	bool valid() const { return f.valid(); }
+	bool is_ready() const { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+
+	void wait() const { wait_and_help(*pool, f); }
+
+	T get() {
+		wait();
+		return f.get();
+	}
+
+	// the underlying std::future, e.g. to hand to code that blocks for real
+	std::future<T> release() { return std::move(f); }
+};
+
+// spawn: add_task, returning a helping jd::future
+template<class F>
+auto spawn(threadpool & pool, F && fn, task_priority pri = task_priority::normal)
+	-> future<decltype(std::declval<typename std::decay<F>::type&>()())> {
+	typedef decltype(std::declval<typename std::decay<F>::type&>()()) Rt;
+	return future<Rt>(pool, pool.add_task(pri, std::forward<F>(fn)));
+}
+
+}
@@ -0,0 +1,38 @@
+#include "stdafx.h"
+#include <jd/base/base.h>
+#include <jd/thread/main_queue.h>
+#include <jd/thread/thread.h>
+#include <jd/base/Timing.h>
+
+namespace jd {
+
+int main_queue::drain(double budget_seconds)
+{
+	ASSERT( this != &GetMainQueue() || IsMainThread() );
+
+	SimpleTimer timer;
+	timer.Start();
+
+	// this frame's batch: last frame's leftovers, then everything posted up to now
+	size_t ready = queue.collect();
+	int ran = 0;
+	task t;
+	while(ready > 0 && queue.try_pop(t)) {
+		--ready;
+		t();
+		t = task();     // drop the callable's captures now, not at the next pop
+		++ran;
+		if(timer.GetElapsedTime() >= budget_seconds) {
+			break;
+		}
+	}
+	return ran;
+}
+
+main_queue & GetMainQueue()
+{
+	static main_queue queue;
+	return queue;
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <jd/thread/task.hpp>
+#include <jd/thread/mpsc_queue.hpp>
+
+#include <utility>
+
+namespace jd {
+
+// main_queue -- hands work from any thread to one consumer thread, normally the main thread,
+// which runs it a frame at a time.  post() is lock-free and doesn't allocate beyond one small node
+// (callables that fit a task's inline storage aren't copied to the heap).
+// drain() runs what was posted before it was called, oldest first, and stops early once
+// budget_seconds have gone by (timed with SimpleTimer), so a burst of callbacks is spread over
+// several frames instead of stalling one.  Whatever it leaves runs first on the next drain().
+// Callbacks posted while a drain is running wait for the next one, so a callback that posts
+// itself again can't keep a drain going.
+//
+// EXAMPLE:
+//   // worker thread
+//   jd::GetMainQueue().post([mesh]{ UploadMesh( mesh ); });
+//
+//   // main loop
+//   jd::GetMainQueue().drain( 0.002 );
+//   RenderFrame();
+//
+class main_queue {
+	mpsc_queue<task> queue;
+
+public:
+	main_queue() {}
+
+	main_queue(const main_queue&) = delete;
+	main_queue& operator=(const main_queue&) = delete;
+
+	// any thread
+	template<typename F>
+	void post(F && fn) {
+		queue.push(task(std::forward<F>(fn)));
+	}
+	void post(task && t) {
+		queue.push(std::move(t));
+	}
+
+	// Consumer thread only (for GetMainQueue(), the main thread; it asserts IsMainThread()).
+	// Runs at least one callback if any are waiting, then keeps going until the batch is done or
+	// the budget is spent.  Returns how many ran.  If a callback throws, the exception propagates
+	// and the rest of the batch stays queued.
+	int drain(double budget_seconds);
+
+	// consumer thread only; a hint, since other threads may be posting meanwhile
+	bool empty() const { return queue.empty(); }
+};
+
+// The process-wide queue for the main thread (the one that called ThreadSystemInit()).
+main_queue & GetMainQueue();
+
+}
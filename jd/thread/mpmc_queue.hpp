@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+#include <jd/thread/spin.hpp>
+
+namespace jd {
+
+// mpmc_queue -- a bounded, lock-free, multi-producer/multi-consumer FIFO ring.
+// This is Dmitry Vyukov's design: every cell carries a sequence number that says whose turn it is,
+// so producers and consumers each claim a position with one CAS and never wait on each other's locks.
+//   cell.sequence == pos            the cell is free for the producer of position pos
+//   cell.sequence == pos + 1        the cell holds the item for the consumer of position pos
+//   cell.sequence == pos + capacity the consumer is done; the cell is free for the next lap
+// Capacity is rounded up to a power of two.  T only needs to be default-constructible and movable.
+//
+// try_push/try_pop never block and fail when the queue is full/empty.
+// push/pop spin, then yield, until they succeed.
+// try_push_batch/try_pop_batch claim a run of cells with a single CAS; they may wait briefly on a
+// thread that has claimed an earlier cell in the run and hasn't finished with it yet.
+template<typename T>
+class mpmc_queue {
+	struct cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	// padding rather than alignas, so the queue doesn't need over-aligned new
+	char pad0[cache_line_size];
+	std::unique_ptr<cell[]> buffer;
+	const size_t mask;
+	char pad1[cache_line_size - sizeof(std::unique_ptr<cell[]>) - sizeof(size_t)];
+	std::atomic<size_t> enqueue_pos;
+	char pad2[cache_line_size - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> dequeue_pos;
+	char pad3[cache_line_size - sizeof(std::atomic<size_t>)];
+
+public:
+	explicit mpmc_queue(size_t capacity = 1024)
+		: buffer(new cell[round_up(capacity)]), mask(round_up(capacity) - 1), enqueue_pos(0), dequeue_pos(0) {
+		for(size_t i = 0; i <= mask; i++) {
+			buffer[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	mpmc_queue(const mpmc_queue&) = delete;
+	mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+	size_t capacity() const { return mask + 1; }
+
+	// approximate; exact only when nobody is pushing or popping
+	size_t size() const {
+		size_t e = enqueue_pos.load(std::memory_order_relaxed);
+		size_t d = dequeue_pos.load(std::memory_order_relaxed);
+		return (e > d) ? e - d : 0;
+	}
+	bool empty() const { return size() == 0; }
+
+	// v is only moved from if the push succeeds
+	bool try_push(T && v) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for(;;) {
+			cell & c = buffer[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if(dif == 0) {
+				if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c.data = std::move(v);
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(dif < 0) {
+				return false;   // full
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T & out) {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for(;;) {
+			cell & c = buffer[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if(dif == 0) {
+				if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					out = std::move(c.data);
+					c.data = T();
+					c.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(dif < 0) {
+				return false;   // empty
+			} else {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void push(T && v) {
+		for(int spins = 0; !try_push(std::move(v)); spins++) {
+			backoff(spins);
+		}
+	}
+
+	void pop(T & out) {
+		for(int spins = 0; !try_pop(out); spins++) {
+			backoff(spins);
+		}
+	}
+
+	// push up to n items from items[0..n), return how many went in (a prefix of items)
+	size_t try_push_batch(T * items, size_t n) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for(;;) {
+			size_t k = (n < capacity()) ? n : capacity();
+			bool stale = false;
+			// shrink the run until its last cell is free for this lap
+			while(k > 0) {
+				const size_t last = pos + k - 1;
+				intptr_t dif = (intptr_t)buffer[last & mask].sequence.load(std::memory_order_acquire) - (intptr_t)last;
+				if(dif == 0) {
+					break;
+				}
+				if(dif > 0) {
+					stale = true;
+					break;
+				}
+				k >>= 1;
+			}
+			if(stale) {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if(k == 0) {
+				return 0;
+			}
+			if(enqueue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+				for(size_t i = 0; i < k; i++) {
+					cell & c = buffer[(pos + i) & mask];
+					for(int spins = 0; c.sequence.load(std::memory_order_acquire) != pos + i; spins++) {
+						backoff(spins);
+					}
+					c.data = std::move(items[i]);
+					c.sequence.store(pos + i + 1, std::memory_order_release);
+				}
+				return k;
+			}
+		}
+	}
+
+	// pop up to max items into out[0..max), return how many came out
+	size_t try_pop_batch(T * out, size_t max) {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for(;;) {
+			size_t k = (max < capacity()) ? max : capacity();
+			bool stale = false;
+			// shrink the run until its last cell has been filled
+			while(k > 0) {
+				const size_t last = pos + k - 1;
+				intptr_t dif = (intptr_t)buffer[last & mask].sequence.load(std::memory_order_acquire) - (intptr_t)(last + 1);
+				if(dif == 0) {
+					break;
+				}
+				if(dif > 0) {
+					stale = true;
+					break;
+				}
+				k >>= 1;
+			}
+			if(stale) {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if(k == 0) {
+				return 0;
+			}
+			if(dequeue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+				for(size_t i = 0; i < k; i++) {
+					cell & c = buffer[(pos + i) & mask];
+					for(int spins = 0; c.sequence.load(std::memory_order_acquire) != pos + i + 1; spins++) {
+						backoff(spins);
+					}
+					out[i] = std::move(c.data);
+					c.data = T();
+					c.sequence.store(pos + i + mask + 1, std::memory_order_release);
+				}
+				return k;
+			}
+		}
+	}
+
+private:
+	static size_t round_up(size_t n) {
+		size_t p = 2;
+		while(p < n) {
+			p <<= 1;
+		}
+		return p;
+	}
+
+	static void backoff(int spins) {
+		if(spins < 64) {
+			cpu_relax();
+		} else {
+			std::this_thread::yield();
+		}
+	}
+};
+
+}
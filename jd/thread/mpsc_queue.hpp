@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+namespace jd {
+
+// mpsc_queue -- an unbounded FIFO with any number of producers and a single consumer.
+// push() is lock-free: the item goes into a node that is CAS'd onto a shared stack.
+// The consumer takes the whole stack with one exchange (collect()), reverses it into a private
+// list, and pops from that without touching shared state again until it runs dry, so a burst of
+// pushes costs the consumer one atomic operation, not one per item.
+// Items from one producer come out in the order that producer pushed them.
+//
+// EXAMPLE:
+//   jd::mpsc_queue<LoadedMesh> loaded;
+//   pool.add_task([&]{ loaded.push( LoadMesh( path ) ); });     // any thread
+//   LoadedMesh m;
+//   while( loaded.try_pop( m ) ) Upload( m );                   // the one consumer thread
+template<typename T>
+class mpsc_queue {
+	struct node {
+		node * next;
+		T value;
+		explicit node(T && v) : next(nullptr), value(std::move(v)) {}
+	};
+
+	alignas(64) std::atomic<node*> pushed;  // producers' stack, newest first
+	alignas(64) node * head;                // consumer's list, oldest first
+	node * tail;
+	size_t count;                           // length of the consumer's list
+
+public:
+	mpsc_queue() : pushed(nullptr), head(nullptr), tail(nullptr), count(0) {}
+	~mpsc_queue() {
+		collect();
+		while(head) {
+			node * n = head;
+			head = n->next;
+			delete n;
+		}
+	}
+
+	mpsc_queue(const mpsc_queue&) = delete;
+	mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+	// any thread
+	void push(T && value) {
+		node * n = new node(std::move(value));
+		node * top = pushed.load(std::memory_order_relaxed);
+		do {
+			n->next = top;
+		} while(!pushed.compare_exchange_weak(top, n, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	// Consumer only; a hint, since producers may be pushing meanwhile.
+	bool empty() const {
+		return pushed.load(std::memory_order_relaxed) == nullptr && count == 0;
+	}
+
+	// Consumer only.  Move everything pushed so far behind what was collected before,
+	// and return how many items are now ready to pop without collecting again.
+	size_t collect() {
+		node * n = pushed.exchange(nullptr, std::memory_order_acquire);
+		node * first = nullptr;
+		node * last = n;
+		size_t added = 0;
+		while(n) {
+			node * next = n->next;
+			n->next = first;
+			first = n;
+			n = next;
+			++added;
+		}
+		if(first) {
+			if(tail) {
+				tail->next = first;
+			} else {
+				head = first;
+			}
+			tail = last;
+			count += added;
+		}
+		return count;
+	}
+
+	// Consumer only: how many items collect() has made ready.
+	size_t collected() const { return count; }
+
+	// Consumer only.  Pops the oldest collected item, collecting first if there are none.
+	bool try_pop(T & out) {
+		if(!head && !collect()) {
+			return false;
+		}
+		node * n = head;
+		head = n->next;
+		if(!head) {
+			tail = nullptr;
+		}
+		--count;
+		out = std::move(n->value);
+		delete n;
+		return true;
+	}
+};
+
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <jd/thread/threadpool.hpp>
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <iterator>
+#include <functional>
+
+namespace jd {
+
+// How parallel_for / parallel_reduce hand out work.  Both cut [begin,end) into chunks of `grain` indices.
+// static_chunks: the caller and up to pool.size() helper tasks claim chunks in order from a shared counter.
+//   Cheapest when every chunk costs about the same.
+// adaptive: the range of chunks is split in halves recursively, and each split pushes its right half as a pool task.
+//   Idle workers steal the big halves while busy ones keep splitting small ones, which evens out irregular work.
+//   Pair it with schedule_policy::work_stealing, so the halves land on the splitting worker's own deque.
+// Either way the calling thread works too: it runs chunks, and then runs queued pool tasks until every chunk is done.
+enum class partitioner {
+	static_chunks,
+	adaptive,
+};
+
+namespace detail {
+
+template<typename F>
+struct chunk_state {
+	chunk_state(const F & f, long n) : fn(&f), count(n), next(0), remaining(n) {}
+
+	const F * fn;                // only touched while a chunk is claimed, so it never outlives the caller
+	const long count;
+	std::atomic<long> next;      // next unclaimed chunk (static_chunks)
+	std::atomic<long> remaining; // chunks not finished yet
+
+	std::mutex error_lock;
+	std::exception_ptr error;    // first exception thrown by fn, rethrown on the calling thread
+};
+
+template<typename F>
+void run_chunk(chunk_state<F> & st, long c) {
+	try {
+		(*st.fn)(c);
+	} catch(...) {
+		std::lock_guard<std::mutex> lock(st.error_lock);
+		if(!st.error) {
+			st.error = std::current_exception();
+		}
+	}
+	st.remaining.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+template<typename F>
+void claim_chunks(chunk_state<F> & st) {
+	for(;;) {
+		long c = st.next.fetch_add(1, std::memory_order_relaxed);
+		if(c >= st.count) {
+			return;
+		}
+		run_chunk(st, c);
+	}
+}
+
+template<typename F>
+void split_chunks(threadpool & pool, const std::shared_ptr<chunk_state<F>> & st, long c0, long c1) {
+	while(c1 - c0 > 1) {
+		long mid = c0 + (c1 - c0) / 2;
+		std::shared_ptr<chunk_state<F>> keep = st;
+		pool.add_task_unbounded(task([&pool, keep, mid, c1]{
+			split_chunks(pool, keep, mid, c1);
+		}));
+		c1 = mid;
+	}
+	run_chunk(*st, c0);
+}
+
+// run fn(c) for every c in [0,count), then return once all of them have finished
+template<typename F>
+void parallel_chunks(threadpool & pool, long count, const F & fn, partitioner part) {
+	if(count <= 0) {
+		return;
+	}
+	if(count == 1 || pool.size() == 0) {
+		for(long c = 0; c < count; c++) {
+			fn(c);
+		}
+		return;
+	}
+
+	// helpers that get dequeued late only see an exhausted counter, but they still hold the state.
+	// That state is the one allocation a parallel_for makes: the helper and split tasks fit in a task inline.
+	std::shared_ptr<chunk_state<F>> st = std::make_shared<chunk_state<F>>(fn, count);
+	if(part == partitioner::static_chunks) {
+		const long helpers = (count - 1 < (long)pool.size()) ? count - 1 : (long)pool.size();
+		for(long i = 0; i < helpers; i++) {
+			pool.add_task_unbounded(task([st]{ claim_chunks(*st); }));
+		}
+		claim_chunks(*st);
+	} else {
+		split_chunks(pool, st, 0, count);
+	}
+
+	chunk_state<F> * raw = st.get();
+	pool.help_until([raw]{ return raw->remaining.load(std::memory_order_acquire) == 0; });
+	if(st->error) {
+		std::rethrow_exception(st->error);
+	}
+}
+
+} // namespace detail
+
+// parallel_for: call fn(i) for each i in [begin,end), spread over the pool in chunks of `grain` indices.
+// IndexT is an integer type.  Returns when every call has finished; rethrows the first exception fn threw.
+//
+// EXAMPLE:
+//   parallel_for( pool, 0, (int)points.size(), 4096, [&](int i){ out[i] = mat_mulPoint( M, points[i] ); } );
+//
+template<typename IndexT, typename F>
+void parallel_for(threadpool & pool, IndexT begin, IndexT end, IndexT grain, const F & fn,
+                  partitioner part = partitioner::adaptive) {
+	if(!(begin < end)) {
+		return;
+	}
+	if(grain < 1) {
+		grain = 1;
+	}
+	const long count = (long)((end - begin + grain - 1) / grain);
+	auto chunk = [&](long c) {
+		const IndexT b = begin + (IndexT)c * grain;
+		const IndexT e = (end - b > grain) ? b + grain : end;
+		for(IndexT i = b; i < e; ++i) {
+			fn(i);
+		}
+	};
+	detail::parallel_chunks(pool, count, chunk, part);
+}
+
+// parallel_reduce: fold [begin,end) into a single T.
+// body(b, e, identity) reduces the sub-range [b,e) and returns its partial result;
+// combine(x, y) merges two partial results and must be associative.
+// Partials are combined in index order on the calling thread, so for a given grain the result is deterministic,
+// even for floating point.
+//
+// EXAMPLE:
+//   float sum = parallel_reduce( pool, 0, n, 4096, 0.0f,
+//       [&](int b, int e, float acc){ for(int i=b; i<e; i++){ acc += x[i]; } return acc; },
+//       [](float a, float b){ return a + b; } );
+//
+template<typename IndexT, typename T, typename Body, typename Combine>
+T parallel_reduce(threadpool & pool, IndexT begin, IndexT end, IndexT grain, const T & identity,
+                  const Body & body, const Combine & combine, partitioner part = partitioner::adaptive) {
+	if(!(begin < end)) {
+		return identity;
+	}
+	if(grain < 1) {
+		grain = 1;
+	}
+	const long count = (long)((end - begin + grain - 1) / grain);
+	std::vector<T> partial(count, identity);
+	auto chunk = [&](long c) {
+		const IndexT b = begin + (IndexT)c * grain;
+		const IndexT e = (end - b > grain) ? b + grain : end;
+		partial[c] = body(b, e, identity);
+	};
+	detail::parallel_chunks(pool, count, chunk, part);
+
+	T result = identity;
+	for(long c = 0; c < count; c++) {
+		result = combine(result, partial[c]);
+	}
+	return result;
+}
+
+namespace detail {
+
+// The two-pass blocked scan behind parallel_inclusive_scan / parallel_exclusive_scan.
+// Pass one folds each chunk of `grain` elements to a single value, in parallel; the calling thread then
+// scans those totals to get each chunk's carry-in, and pass two scans every chunk again from its carry.
+// Each element is read twice, but both passes stream memory in order, so it scales until memory bandwidth runs out.
+template<typename InIt, typename OutIt, typename T, typename Op>
+void blocked_scan(threadpool & pool, InIt first, long n, OutIt out, long grain, const T & init, const Op & op,
+                  bool inclusive, bool has_init, partitioner part) {
+	if(grain < 1) {
+		grain = 1;
+	}
+	const long count = (n + grain - 1) / grain;
+	std::vector<T> carry(count, init);
+	if(count > 1) {
+		std::vector<T> total(count, init);
+		auto fold = [&](long c) {
+			InIt it = first + c * grain;
+			const long e = (n - c * grain > grain) ? grain : n - c * grain;
+			T acc = *it;
+			++it;
+			for(long i = 1; i < e; ++i, ++it) {
+				acc = op(acc, *it);
+			}
+			total[c] = acc;
+		};
+		// the last chunk's total is never needed
+		detail::parallel_chunks(pool, count - 1, fold, part);
+		carry[1] = has_init ? op(init, total[0]) : total[0];
+		for(long c = 2; c < count; c++) {
+			carry[c] = op(carry[c - 1], total[c - 1]);
+		}
+	}
+
+	auto scan = [&](long c) {
+		InIt it = first + c * grain;
+		OutIt o = out + c * grain;
+		const long e = (n - c * grain > grain) ? grain : n - c * grain;
+		long i = 0;
+		T acc = carry[c];
+		if(c == 0 && !has_init) {
+			acc = *it;  // inclusive scan with no init: the first element starts the fold
+			*o = acc;
+			++it;
+			++o;
+			i = 1;
+		}
+		for(; i < e; ++i, ++it, ++o) {
+			if(inclusive) {
+				acc = op(acc, *it);
+				*o = acc;
+			} else {
+				T x = *it;  // read before writing, so out may alias first
+				*o = acc;
+				acc = op(acc, x);
+			}
+		}
+	};
+	detail::parallel_chunks(pool, count, scan, part);
+}
+
+} // namespace detail
+
+// parallel_inclusive_scan: out[i] = in[0] op in[1] op ... op in[i], like std::inclusive_scan.
+// op must be associative.  Work is split into chunks of `grain` elements, and for a given grain the result is
+// deterministic, even for floating point.  out may be first (in place).  Returns the end of the output.
+//
+// EXAMPLE: running offsets from per-cell counts
+//   parallel_inclusive_scan( pool, counts.begin(), counts.end(), ends.begin(), 65536 );
+//
+template<typename InIt, typename OutIt, typename Op>
+OutIt parallel_inclusive_scan(threadpool & pool, InIt first, InIt last, OutIt out, long grain, const Op & op,
+                              partitioner part = partitioner::static_chunks) {
+	typedef typename std::iterator_traits<InIt>::value_type T;
+	const long n = (long)(last - first);
+	if(n <= 0) {
+		return out;
+	}
+	detail::blocked_scan(pool, first, n, out, grain, T(*first), op, true, false, part);
+	return out + n;
+}
+
+template<typename InIt, typename OutIt>
+OutIt parallel_inclusive_scan(threadpool & pool, InIt first, InIt last, OutIt out, long grain) {
+	typedef typename std::iterator_traits<InIt>::value_type T;
+	return parallel_inclusive_scan(pool, first, last, out, grain, std::plus<T>());
+}
+
+// parallel_exclusive_scan: out[0] = init, out[i] = init op in[0] op ... op in[i-1], like std::exclusive_scan.
+//
+// EXAMPLE: where each bucket's items start in a packed array
+//   parallel_exclusive_scan( pool, counts.begin(), counts.end(), starts.begin(), 65536, 0 );
+//
+template<typename InIt, typename OutIt, typename T, typename Op>
+OutIt parallel_exclusive_scan(threadpool & pool, InIt first, InIt last, OutIt out, long grain, const T & init, const Op & op,
+                              partitioner part = partitioner::static_chunks) {
+	const long n = (long)(last - first);
+	if(n <= 0) {
+		return out;
+	}
+	detail::blocked_scan(pool, first, n, out, grain, init, op, false, true, part);
+	return out + n;
+}
+
+template<typename InIt, typename OutIt, typename T>
+OutIt parallel_exclusive_scan(threadpool & pool, InIt first, InIt last, OutIt out, long grain, const T & init) {
+	return parallel_exclusive_scan(pool, first, last, out, grain, init, std::plus<T>());
+}
+
+}
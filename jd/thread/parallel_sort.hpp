@@ -0,0 +1,266 @@
+#pragma once
+
+#include <jd/thread/parallel.hpp>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+
+namespace jd {
+
+namespace detail {
+
+const long sort_grain = 16384;      // below this many elements a range is sorted on one thread
+const long merge_grain = 65536;     // outputs per merge task
+const long radix_block = 16384;     // fewest elements a radix histogram block covers
+
+// Merge path: how many of the first k outputs of a stable merge of a[0,na) with b[0,nb) come from a.
+// Ties go to a, as in std::merge, so merges cut at these points and run separately give the same output.
+template<typename ItA, typename ItB, typename Comp>
+long merge_split(ItA a, long na, ItB b, long nb, long k, Comp & comp) {
+	long lo = (k > nb) ? k - nb : 0;
+	long hi = (k < na) ? k : na;
+	while(lo < hi) {
+		const long i = lo + (hi - lo) / 2;
+		if(!comp(b[k - i - 1], a[i])) {
+			lo = i + 1;     // a[i] would still come out ahead of b[k-i-1]
+		} else {
+			hi = i;
+		}
+	}
+	return lo;
+}
+
+// One merge round: neighbouring runs of `width` sorted chunks in src are merged in pairs into dst.
+// Every pair is cut into pieces of about merge_grain outputs, so the last rounds, with only a pair or two left,
+// still spread over the pool.  A run with no partner is just moved across.
+template<typename Src, typename Dst, typename Comp>
+void merge_round(threadpool & pool, Src src, Dst dst, const std::vector<long> & bounds, long width, Comp & comp) {
+	struct piece {
+		long a0, a1, b0, b1, out;
+	};
+	std::vector<piece> pieces;
+	const long chunks = (long)bounds.size() - 1;
+	for(long c = 0; c < chunks; c += 2 * width) {
+		const long lo = bounds[c];
+		const long mid = bounds[std::min(c + width, chunks)];
+		const long hi = bounds[std::min(c + 2 * width, chunks)];
+		const long m = hi - lo;
+		const long parts = std::max(1L, m / merge_grain);
+		long pa = 0, pb = 0;
+		for(long p = 1; p <= parts; p++) {
+			const long k = (p == parts) ? m : m * p / parts;
+			const long i = merge_split(src + lo, mid - lo, src + mid, hi - mid, k, comp);
+			piece q = { lo + pa, lo + i, mid + pb, mid + (k - i), lo + pa + pb };
+			pieces.push_back(q);
+			pa = i;
+			pb = k - i;
+		}
+	}
+	parallel_for(pool, 0L, (long)pieces.size(), 1L, [&](long p) {
+		const piece & q = pieces[p];
+		std::merge(std::make_move_iterator(src + q.a0), std::make_move_iterator(src + q.a1),
+		           std::make_move_iterator(src + q.b0), std::make_move_iterator(src + q.b1), dst + q.out, comp);
+	});
+}
+
+// Sort one chunk per thread (pool.size() + 1 of them, rounded up to a power of two), then merge them pairwise
+// through a scratch buffer, ping-ponging between it and the input.
+template<typename It, typename Comp>
+void merge_sort(threadpool & pool, It first, It last, Comp comp, bool stable) {
+	typedef typename std::iterator_traits<It>::value_type T;
+	const long n = (long)(last - first);
+	long chunks = 1;
+	while(chunks < (long)pool.size() + 1 && n / (chunks * 2) >= sort_grain) {
+		chunks *= 2;
+	}
+	if(chunks == 1) {
+		if(stable) {
+			std::stable_sort(first, last, comp);
+		} else {
+			std::sort(first, last, comp);
+		}
+		return;
+	}
+
+	std::vector<long> bounds(chunks + 1);
+	for(long c = 0; c <= chunks; c++) {
+		bounds[c] = n * c / chunks;
+	}
+	parallel_for(pool, 0L, chunks, 1L, [&](long c) {
+		if(stable) {
+			std::stable_sort(first + bounds[c], first + bounds[c + 1], comp);
+		} else {
+			std::sort(first + bounds[c], first + bounds[c + 1], comp);
+		}
+	});
+
+	std::unique_ptr<T[]> buf(new T[n]);
+	bool in_buf = false;
+	for(long width = 1; width < chunks; width *= 2) {
+		if(in_buf) {
+			merge_round(pool, buf.get(), first, bounds, width, comp);
+		} else {
+			merge_round(pool, first, buf.get(), bounds, width, comp);
+		}
+		in_buf = !in_buf;
+	}
+	if(in_buf) {
+		T * from = buf.get();
+		parallel_for(pool, 0L, n, merge_grain, [&](long i) { first[i] = std::move(from[i]); });
+	}
+}
+
+} // namespace detail
+
+// parallel_sort: sort [first,last) with comp, like std::sort, on the pool.  The calling thread sorts too.
+// Small ranges (or a pool with no workers) just call std::sort.  Large ones are cut into one chunk per thread,
+// the chunks sorted in parallel and then merged in parallel through a scratch buffer of last-first elements,
+// so the value type has to be default constructible and move assignable.
+//
+// EXAMPLE:
+//   parallel_sort( pool, depths.begin(), depths.end() );
+//   parallel_sort( pool, draws.begin(), draws.end(), [](const draw & a, const draw & b){ return a.key < b.key; } );
+//
+template<typename It, typename Comp>
+void parallel_sort(threadpool & pool, It first, It last, Comp comp) {
+	detail::merge_sort(pool, first, last, comp, false);
+}
+
+template<typename It>
+void parallel_sort(threadpool & pool, It first, It last) {
+	typedef typename std::iterator_traits<It>::value_type T;
+	detail::merge_sort(pool, first, last, std::less<T>(), false);
+}
+
+// parallel_stable_sort: the same, keeping equal elements in their original order (std::stable_sort).
+template<typename It, typename Comp>
+void parallel_stable_sort(threadpool & pool, It first, It last, Comp comp) {
+	detail::merge_sort(pool, first, last, comp, true);
+}
+
+template<typename It>
+void parallel_stable_sort(threadpool & pool, It first, It last) {
+	typedef typename std::iterator_traits<It>::value_type T;
+	detail::merge_sort(pool, first, last, std::less<T>(), true);
+}
+
+// radix_traits<K> -- maps a key to an unsigned integer of the same size that sorts in the same order.
+// Signed integers flip the sign bit.  Floats flip the sign bit of positives and every bit of negatives,
+// which orders them -NaN < -inf < ... < -0 < +0 < ... < +inf < +NaN.
+template<typename K> struct radix_traits;
+
+template<> struct radix_traits<uint32_t> {
+	typedef uint32_t bits;
+	static bits to_bits(uint32_t k) { return k; }
+};
+template<> struct radix_traits<int32_t> {
+	typedef uint32_t bits;
+	static bits to_bits(int32_t k) { return (uint32_t)k ^ 0x80000000u; }
+};
+template<> struct radix_traits<uint64_t> {
+	typedef uint64_t bits;
+	static bits to_bits(uint64_t k) { return k; }
+};
+template<> struct radix_traits<int64_t> {
+	typedef uint64_t bits;
+	static bits to_bits(int64_t k) { return (uint64_t)k ^ 0x8000000000000000ull; }
+};
+template<> struct radix_traits<float> {
+	typedef uint32_t bits;
+	static bits to_bits(float k) {
+		uint32_t b;
+		std::memcpy(&b, &k, sizeof(b));
+		return (b & 0x80000000u) ? ~b : (b | 0x80000000u);
+	}
+};
+template<> struct radix_traits<double> {
+	typedef uint64_t bits;
+	static bits to_bits(double k) {
+		uint64_t b;
+		std::memcpy(&b, &k, sizeof(b));
+		return (b & 0x8000000000000000ull) ? ~b : (b | 0x8000000000000000ull);
+	}
+};
+
+// parallel_radix_sort: a stable LSD radix sort, eight bits per pass, of [first,last) by key(element),
+// which must return one of the key types radix_traits knows (32 or 64 bit integers, float, double).
+// Every pass splits the range into blocks; each block counts its digits in parallel, the counts are
+// scanned (digit-major, so equal digits keep block order), and the blocks scatter in parallel.
+// Passes where every key has the same digit are skipped, so small integer keys take one or two passes.
+// Like parallel_sort it needs a scratch buffer of last-first elements.
+//
+// EXAMPLE:
+//   parallel_radix_sort( pool, &depths[0], &depths[0] + depths.size() );
+//   parallel_radix_sort( pool, &draws[0], &draws[0] + draws.size(), [](const draw & d){ return d.depth; } );
+//
+template<typename T, typename KeyFn>
+void parallel_radix_sort(threadpool & pool, T * first, T * last, const KeyFn & key) {
+	typedef typename std::decay<decltype(key(*first))>::type K;
+	typedef radix_traits<K> traits;
+	typedef typename traits::bits bits;
+	const long n = (long)(last - first);
+	if(n < 256) {
+		std::stable_sort(first, last, [&](const T & a, const T & b) { return traits::to_bits(key(a)) < traits::to_bits(key(b)); });
+		return;
+	}
+
+	const long blocks = std::max(1L, std::min(4 * ((long)pool.size() + 1), n / detail::radix_block));
+	auto block_begin = [&](long b) { return n * b / blocks; };
+
+	std::unique_ptr<T[]> buf(new T[n]);
+	std::vector<size_t> counts(blocks * 256);
+	T * src = first;
+	T * dst = buf.get();
+	for(int shift = 0; shift < (int)sizeof(bits) * 8; shift += 8) {
+		std::fill(counts.begin(), counts.end(), 0);
+		detail::parallel_chunks(pool, blocks, [&](long b) {
+			size_t * count = &counts[b * 256];
+			for(long i = block_begin(b), e = block_begin(b + 1); i < e; i++) {
+				count[(traits::to_bits(key(src[i])) >> shift) & 0xff]++;
+			}
+		}, partitioner::static_chunks);
+
+		// counts become each block's first output index per digit
+		size_t at = 0;
+		bool trivial = false;
+		for(int d = 0; d < 256; d++) {
+			const size_t start = at;
+			for(long b = 0; b < blocks; b++) {
+				const size_t c = counts[b * 256 + d];
+				counts[b * 256 + d] = at;
+				at += c;
+			}
+			if(at - start == (size_t)n) {
+				trivial = true;
+				break;
+			}
+		}
+		if(trivial) {
+			continue;
+		}
+
+		detail::parallel_chunks(pool, blocks, [&](long b) {
+			size_t * next = &counts[b * 256];
+			for(long i = block_begin(b), e = block_begin(b + 1); i < e; i++) {
+				dst[next[(traits::to_bits(key(src[i])) >> shift) & 0xff]++] = std::move(src[i]);
+			}
+		}, partitioner::static_chunks);
+		std::swap(src, dst);
+	}
+	if(src != first) {
+		parallel_for(pool, 0L, n, detail::merge_grain, [&](long i) { first[i] = std::move(src[i]); });
+	}
+}
+
+template<typename T>
+void parallel_radix_sort(threadpool & pool, T * first, T * last) {
+	parallel_radix_sort(pool, first, last, [](const T & v) { return v; });
+}
+
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <jd/thread/threadpool.hpp>
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <cassert>
+
+namespace jd {
+
+// parallel: any number of items in the stage at once.
+// serial_in_order: one item at a time, in the order the source produced them.
+// serial_out_of_order: one item at a time, in whatever order they arrive.
+enum class stage_mode {
+	parallel,
+	serial_in_order,
+	serial_out_of_order,
+};
+
+// pipeline -- a stream of Items pushed through a chain of stages on a threadpool.
+// At most max_in_flight Items exist at once: they're allocated when the pipeline is built and
+// recycled, so an unbounded stream runs in fixed memory, and the buffer in front of each serial
+// stage never holds more than max_in_flight entries.
+// No thread belongs to a stage.  Each item travels as a pool task, running parallel stages
+// as it reaches them; at a serial stage that's busy (or, in order, not yet at this item)
+// it waits in the stage's buffer, and whoever finishes the stage picks the next one up.
+// When an item leaves the last stage its slot goes back to the source.
+//
+// EXAMPLE:
+//   struct batch { std::vector<std::string> lines; std::vector<vec3f> points; };
+//   jd::pipeline<batch> p( 16 );
+//   p.add_stage( stage_mode::parallel,        [](batch & b){ Parse( b.lines, b.points ); } );
+//   p.add_stage( stage_mode::parallel,        [&](batch & b){ for(auto & v : b.points) v = mat_mulPoint( M, v ); } );
+//   p.add_stage( stage_mode::serial_in_order, [&](batch & b){ Accumulate( stats, b.points ); } );
+//   p.run( pool, [&](batch & b){ return ReadLines( file, 1000, b.lines ); } );
+//
+// The source is only ever called by one thread at a time.  Items are reused as they are, so the
+// source should reset whatever the stages left in them.  If a stage or the source throws, the source
+// stops, the stages are skipped for items already in flight, and run() rethrows the first exception.
+template<typename Item>
+class pipeline {
+	struct stage {
+		stage_mode mode;
+		std::function<void(Item&)> fn;
+
+		std::mutex access;
+		bool busy;                      // an item is in this (serial) stage
+		uint64_t next_seq;              // serial_in_order: the item it takes next
+		std::vector<int> by_seq;        // serial_in_order: waiting slots, indexed by seq % max_in_flight
+		ring_buffer<int> arrivals;      // serial_out_of_order: waiting slots, first come first served
+	};
+
+	struct slot {
+		Item item;
+		uint64_t seq;
+	};
+
+	const int max_in_flight;
+	std::vector<std::unique_ptr<stage>> stages;
+	std::vector<slot> slots;
+
+	threadpool * pool;
+	std::function<bool(Item&)> source;
+
+	std::mutex free_access;
+	std::vector<int> free_slots;
+	std::atomic<int> free_count;
+	std::atomic<bool> source_busy;
+	std::atomic<bool> ended;
+	std::atomic<int> in_flight;
+	uint64_t next_seq;                  // only touched by whoever holds source_busy
+
+	std::atomic<bool> failed;
+	std::mutex error_lock;
+	std::exception_ptr error;
+
+public:
+	explicit pipeline(int max_in_flight_)
+		: max_in_flight(max_in_flight_ > 0 ? max_in_flight_ : 1), slots(max_in_flight), pool(nullptr),
+		  free_count(0), source_busy(false), ended(true), in_flight(0), next_seq(0), failed(false) {
+	}
+
+	pipeline(const pipeline&) = delete;
+	pipeline& operator=(const pipeline&) = delete;
+
+	~pipeline() {
+		assert(done());
+	}
+
+	pipeline & add_stage(stage_mode mode, std::function<void(Item&)> fn) {
+		assert(done());
+		std::unique_ptr<stage> st(new stage);
+		st->mode = mode;
+		st->fn = std::move(fn);
+		st->busy = false;
+		st->next_seq = 0;
+		st->by_seq.assign(max_in_flight, -1);
+		stages.push_back(std::move(st));
+		return *this;
+	}
+
+	int size() const { return (int)stages.size(); }
+
+	bool done() const { return ended.load(std::memory_order_acquire) && in_flight.load(std::memory_order_acquire) == 0; }
+
+	// Pull items from src until it returns false, push each through every stage, and return when the last
+	// one is through.  The calling thread helps run pool tasks meanwhile.
+	void run(threadpool & p, std::function<bool(Item&)> src) {
+		assert(done());
+		pool = &p;
+		source = std::move(src);
+		error = nullptr;
+		failed.store(false, std::memory_order_relaxed);
+		next_seq = 0;
+		for(auto & st : stages) {
+			st->busy = false;
+			st->next_seq = 0;
+		}
+		free_slots.clear();
+		for(int i = max_in_flight - 1; i >= 0; i--) {
+			free_slots.push_back(i);
+		}
+		free_count.store(max_in_flight, std::memory_order_seq_cst);
+		ended.store(false, std::memory_order_seq_cst);
+
+		pump();
+		pool->help_until([this]{ return done(); });
+		source = nullptr;
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	void fail() {
+		std::lock_guard<std::mutex> lock(error_lock);
+		if(!error) {
+			error = std::current_exception();
+		}
+		failed.store(true, std::memory_order_relaxed);
+	}
+
+	// Fill free slots from the source, one thread at a time.  A thread that frees a slot while someone
+	// else is pumping leaves it to them: the pumper drops source_busy and then looks at free_count again,
+	// and the freer bumps free_count and then tries source_busy (all seq_cst), so one of them sees the other.
+	void pump() {
+		while(!ended.load(std::memory_order_seq_cst) && free_count.load(std::memory_order_seq_cst) > 0) {
+			if(source_busy.exchange(true, std::memory_order_seq_cst)) {
+				return;
+			}
+			while(!ended.load(std::memory_order_relaxed) && free_count.load(std::memory_order_seq_cst) > 0) {
+				int s;
+				{
+					std::lock_guard<std::mutex> lock(free_access);
+					s = free_slots.back();
+					free_slots.pop_back();
+				}
+				free_count.fetch_sub(1, std::memory_order_seq_cst);
+
+				bool more = false;
+				if(!failed.load(std::memory_order_relaxed)) {
+					try {
+						more = source(slots[s].item);
+					} catch(...) {
+						fail();
+					}
+				}
+				if(!more) {
+					release_slot(s);
+					// in_flight goes up before `ended` is published, so done() can't see a gap
+					ended.store(true, std::memory_order_seq_cst);
+					break;
+				}
+				slots[s].seq = next_seq++;
+				in_flight.fetch_add(1, std::memory_order_seq_cst);
+				pool->add_task_unbounded(task([this, s]{ advance(s, 0, false); }));
+			}
+			source_busy.store(false, std::memory_order_seq_cst);
+		}
+	}
+
+	void release_slot(int s) {
+		std::lock_guard<std::mutex> lock(free_access);
+		free_slots.push_back(s);
+		free_count.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	void call(stage & st, Item & item) {
+		if(failed.load(std::memory_order_relaxed)) {
+			return;
+		}
+		try {
+			st.fn(item);
+		} catch(...) {
+			fail();
+		}
+	}
+
+	// carry slot s through stages [i, end); `holding` means it has already been admitted to serial stage i
+	void advance(int s, int i, bool holding) {
+		for(; i < (int)stages.size(); i++, holding = false) {
+			stage & st = *stages[i];
+			if(st.mode == stage_mode::parallel) {
+				call(st, slots[s].item);
+				continue;
+			}
+			if(!holding && !enter(st, s)) {
+				return;     // buffered; whoever finishes this stage will carry it on
+			}
+			call(st, slots[s].item);
+			int next = leave(st);
+			if(next >= 0) {
+				pool->add_task_unbounded(task([this, next, i]{ advance(next, i, true); }));
+			}
+		}
+		finish(s);
+	}
+
+	// admit slot s to serial stage st, or buffer it
+	bool enter(stage & st, int s) {
+		std::lock_guard<std::mutex> lock(st.access);
+		if(st.mode == stage_mode::serial_in_order) {
+			if(st.busy || slots[s].seq != st.next_seq) {
+				st.by_seq[slots[s].seq % max_in_flight] = s;
+				return false;
+			}
+		} else if(st.busy) {
+			st.arrivals.push_back(std::move(s));
+			return false;
+		}
+		st.busy = true;
+		return true;
+	}
+
+	// done with the current item; returns the buffered slot admitted next, or -1
+	int leave(stage & st) {
+		std::lock_guard<std::mutex> lock(st.access);
+		int next = -1;
+		if(st.mode == stage_mode::serial_in_order) {
+			st.next_seq++;
+			int & waiting = st.by_seq[st.next_seq % max_in_flight];
+			if(waiting >= 0 && slots[waiting].seq == st.next_seq) {
+				next = waiting;
+				waiting = -1;
+			}
+		} else {
+			st.arrivals.pop_front(next);
+		}
+		st.busy = (next >= 0);
+		return next;
+	}
+
+	void finish(int s) {
+		release_slot(s);
+		pump();
+		in_flight.fetch_sub(1, std::memory_order_seq_cst);
+	}
+};
+
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace jd {
+
+// stat_now -- the tick source for pool statistics: nanoseconds on the monotonic clock.
+// It's a vDSO call on Linux (no syscall), a few tens of nanoseconds at worst.
+inline int64_t stat_now() {
+	return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline double stat_seconds(int64_t ns) { return (double)ns * 1e-9; }
+
+// histogram -- log2 buckets.  Bucket 0 counts zeros, bucket b counts values in [2^(b-1), 2^b).
+// Times are in nanoseconds, depths in tasks.
+struct histogram {
+	static const int bucket_count = 48;
+
+	uint64_t buckets[bucket_count] = {};
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t max = 0;
+
+	static int bucket_of(uint64_t v) {
+		int b = 0;
+		while(v && b < bucket_count - 1) {
+			v >>= 1;
+			++b;
+		}
+		return b;
+	}
+
+	double mean() const { return count ? (double)sum / (double)count : 0.0; }
+
+	// upper edge of the bucket holding the p-th fraction of values (p in [0,1]), clamped to max
+	uint64_t percentile(double p) const {
+		if(!count) {
+			return 0;
+		}
+		const double want = p * (double)count;
+		uint64_t seen = 0;
+		for(int b = 0; b < bucket_count; b++) {
+			seen += buckets[b];
+			if(seen && (double)seen >= want) {
+				const uint64_t edge = b ? ((uint64_t)1 << b) - 1 : 0;
+				return edge < max ? edge : max;
+			}
+		}
+		return max;
+	}
+
+	histogram & operator+=(const histogram & o) {
+		for(int b = 0; b < bucket_count; b++) {
+			buckets[b] += o.buckets[b];
+		}
+		count += o.count;
+		sum += o.sum;
+		max = (o.max > max) ? o.max : max;
+		return *this;
+	}
+
+	// for the difference between two snapshots; max stays the later one's, since it can't be un-merged
+	histogram & operator-=(const histogram & o) {
+		for(int b = 0; b < bucket_count; b++) {
+			buckets[b] -= o.buckets[b];
+		}
+		count -= o.count;
+		sum -= o.sum;
+		return *this;
+	}
+};
+
+// threadpool_stats -- a snapshot of threadpool::stats().  Counters only ever grow,
+// so the activity over an interval is later.since(earlier).
+struct threadpool_stats {
+	static const uint64_t depth_sample_rate = 8;
+
+	struct worker_stats {
+		uint64_t tasks = 0;         // tasks run
+		uint64_t steals = 0;        // tasks taken from another worker's deque
+		int64_t idle_ns = 0;        // time spent spinning, yielding and parked
+		histogram queued;           // submit-to-start time of each task run
+		histogram running;          // run time of each task
+		histogram lock_wait;        // time blocked acquiring the pool's lock (uncontended acquires aren't timed)
+		histogram depth;            // tasks waiting in the pool, sampled every depth_sample_rate-th task start
+
+		worker_stats & operator+=(const worker_stats & o) {
+			tasks += o.tasks;
+			steals += o.steals;
+			idle_ns += o.idle_ns;
+			queued += o.queued;
+			running += o.running;
+			lock_wait += o.lock_wait;
+			depth += o.depth;
+			return *this;
+		}
+		worker_stats & operator-=(const worker_stats & o) {
+			tasks -= o.tasks;
+			steals -= o.steals;
+			idle_ns -= o.idle_ns;
+			queued -= o.queued;
+			running -= o.running;
+			lock_wait -= o.lock_wait;
+			depth -= o.depth;
+			return *this;
+		}
+	};
+
+	// Bounded pools: how often a full queue made add_task block (and for how long in all),
+	// made add_task / try_add_task turn a task away, or made add_task run it inline.
+	// These are kept whether or not collect_stats is set.
+	uint64_t blocked = 0;
+	int64_t blocked_ns = 0;
+	uint64_t rejected = 0;
+	uint64_t ran_inline = 0;
+
+	// pin_workers: workers whose pin_current_thread() failed, and so run wherever the OS puts them
+	uint64_t pin_failures = 0;
+
+	int64_t taken_at = 0;               // stat_now() when the snapshot was taken
+	size_t queue_depth = 0;             // tasks waiting at that moment (approximate)
+	std::vector<worker_stats> workers;  // one per worker
+	worker_stats outside;               // threads that aren't workers: run_one / help_until callers and producers
+
+	worker_stats total() const {
+		worker_stats t = outside;
+		for(const worker_stats & w : workers) {
+			t += w;
+		}
+		return t;
+	}
+
+	// activity between earlier and this snapshot
+	threadpool_stats since(const threadpool_stats & earlier) const {
+		threadpool_stats d = *this;
+		for(size_t i = 0; i < d.workers.size() && i < earlier.workers.size(); i++) {
+			d.workers[i] -= earlier.workers[i];
+		}
+		d.outside -= earlier.outside;
+		d.blocked -= earlier.blocked;
+		d.blocked_ns -= earlier.blocked_ns;
+		d.rejected -= earlier.rejected;
+		d.ran_inline -= earlier.ran_inline;
+		d.pin_failures -= earlier.pin_failures;
+		return d;
+	}
+};
+
+namespace detail {
+
+// The live side.  Several threads can record into the same counters (the outside slot, lock waits),
+// so updates are relaxed fetch_adds; readers may see a snapshot that's a few updates apart between fields.
+struct live_histogram {
+	std::atomic<uint64_t> buckets[histogram::bucket_count];   // count is their sum, so it isn't kept separately
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+
+	live_histogram() : sum(0), max(0) {
+		for(auto & b : buckets) {
+			b.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void add(uint64_t v) {
+		buckets[histogram::bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(v, std::memory_order_relaxed);
+		uint64_t m = max.load(std::memory_order_relaxed);
+		while(v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed)) {
+		}
+	}
+
+	histogram read() const {
+		histogram h;
+		for(int b = 0; b < histogram::bucket_count; b++) {
+			h.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+			h.count += h.buckets[b];
+		}
+		h.sum = sum.load(std::memory_order_relaxed);
+		h.max = max.load(std::memory_order_relaxed);
+		return h;
+	}
+};
+
+struct live_worker_stats {
+	std::atomic<uint64_t> tasks;
+	std::atomic<uint64_t> steals;
+	std::atomic<int64_t> idle_ns;
+	live_histogram queued;
+	live_histogram running;
+	live_histogram lock_wait;
+	live_histogram depth;
+
+	live_worker_stats() : tasks(0), steals(0), idle_ns(0) {}
+
+	threadpool_stats::worker_stats read() const {
+		threadpool_stats::worker_stats s;
+		s.tasks = tasks.load(std::memory_order_relaxed);
+		s.steals = steals.load(std::memory_order_relaxed);
+		s.idle_ns = idle_ns.load(std::memory_order_relaxed);
+		s.queued = queued.read();
+		s.running = running.read();
+		s.lock_wait = lock_wait.read();
+		s.depth = depth.read();
+		return s;
+	}
+};
+
+} // namespace detail
+
+}
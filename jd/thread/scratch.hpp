@@ -0,0 +1,202 @@
+#pragma once
+
+#include <vector>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace jd {
+
+// scratch_arena -- a bump allocator for temporaries that die together.
+// allocate() carves from the current block and only touches the heap when that runs out;
+// nothing is freed one at a time, the arena is wound back to a mark instead.  Marks nest like a stack,
+// which is what lets a task that helps while it waits run other tasks on the same arena.
+// Winding all the way back to empty folds the blocks into one the size of everything they held,
+// so a thread settles on a single block big enough for its busiest task and stops allocating.
+class scratch_arena {
+	struct block {
+		char * data;
+		size_t size;
+	};
+
+	std::vector<block> blocks;
+	size_t current;     // block being bumped
+	size_t used;        // bytes of it handed out
+
+public:
+	static const size_t min_block = 64 * 1024;
+
+	struct mark {
+		size_t block;
+		size_t used;
+	};
+
+	scratch_arena() : current(0), used(0) {}
+	~scratch_arena() { release(); }
+
+	scratch_arena(const scratch_arena&) = delete;
+	scratch_arena& operator=(const scratch_arena&) = delete;
+
+	// align must be a power of two
+	void * allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+		for(;;) {
+			if(current < blocks.size()) {
+				block & b = blocks[current];
+				const uintptr_t base = (uintptr_t)b.data;
+				const uintptr_t p = (base + used + align - 1) & ~(uintptr_t)(align - 1);
+				if(p + bytes <= base + b.size) {
+					used = (size_t)(p + bytes - base);
+					return (void *)p;
+				}
+				if(current + 1 < blocks.size() && blocks[current + 1].size >= bytes + align) {
+					current++;
+					used = 0;
+					continue;
+				}
+			}
+			add_block(bytes + align);
+		}
+	}
+
+	mark get_mark() const {
+		mark m = { current, used };
+		return m;
+	}
+
+	// free everything allocated since m was taken
+	void rewind(const mark & m) {
+		current = m.block;
+		used = m.used;
+		if(current == 0 && used == 0 && blocks.size() > 1) {
+			coalesce();
+		}
+	}
+
+	void reset() {
+		mark m = { 0, 0 };
+		rewind(m);
+	}
+
+	// hand every block back to the heap; nothing allocated from the arena may still be in use
+	void release() {
+		for(block & b : blocks) {
+			std::free(b.data);
+		}
+		blocks.clear();
+		current = 0;
+		used = 0;
+	}
+
+	// bytes held from the heap
+	size_t capacity() const {
+		size_t n = 0;
+		for(const block & b : blocks) {
+			n += b.size;
+		}
+		return n;
+	}
+
+	// bytes handed out since the last reset (including alignment and the tails of full blocks)
+	size_t in_use() const {
+		size_t n = used;
+		for(size_t i = 0; i < current && i < blocks.size(); i++) {
+			n += blocks[i].size;
+		}
+		return n;
+	}
+
+private:
+	// start a new block after the current one; the ones past it hold nothing live, and are too small
+	void add_block(size_t need) {
+		size_t size = blocks.empty() ? min_block : blocks.back().size * 2;
+		if(size < need) {
+			size = need;
+		}
+		const size_t next = blocks.empty() ? 0 : current + 1;
+		while(blocks.size() > next) {
+			std::free(blocks.back().data);
+			blocks.pop_back();
+		}
+		block b = { static_cast<char *>(std::malloc(size)), size };
+		if(!b.data) {
+			throw std::bad_alloc();
+		}
+		blocks.push_back(b);
+		current = next;
+		used = 0;
+	}
+
+	void coalesce() {
+		const size_t total = capacity();
+		release();
+		block b = { static_cast<char *>(std::malloc(total)), total };
+		if(b.data) {
+			blocks.push_back(b);
+		}
+	}
+};
+
+namespace this_worker {
+
+// The calling thread's scratch arena.  On a pool thread, everything a task allocates from it is freed
+// when the task returns (threadpool marks the arena before each task and winds back to the mark after),
+// so a task can grab temporaries without touching the shared heap.  Don't keep anything from it past
+// the end of the task, or hand it to another task.  Outside a pool task nothing resets it for you:
+// use a scratch_scope.  Nor does it reset between the iterations of a parallel_for, since one task
+// runs a whole chunk of them: loops that take scratch every iteration want a scratch_scope inside too.
+//
+// EXAMPLE:
+//   pool.add_task([&]{
+//       jd::scratch_vector<float> sorted( values.begin(), values.end() );
+//       std::sort( sorted.begin(), sorted.end() );
+//       med = sorted[sorted.size() / 2];
+//   });
+inline scratch_arena & scratch() {
+	static thread_local scratch_arena arena;
+	return arena;
+}
+
+}
+
+// scratch_scope -- winds an arena back, on scope exit, to where it was on entry.
+struct scratch_scope {
+	scratch_arena & arena;
+	const scratch_arena::mark start;
+
+	explicit scratch_scope(scratch_arena & a = this_worker::scratch()) : arena(a), start(a.get_mark()) {}
+	~scratch_scope() { arena.rewind(start); }
+
+	scratch_scope(const scratch_scope&) = delete;
+	scratch_scope& operator=(const scratch_scope&) = delete;
+};
+
+// scratch_allocator -- a standard allocator on a scratch_arena, by default the calling thread's.
+// deallocate() does nothing; the memory comes back when the arena winds back.
+template<typename T>
+class scratch_allocator {
+public:
+	typedef T value_type;
+
+	scratch_allocator() : arena(&this_worker::scratch()) {}
+	explicit scratch_allocator(scratch_arena & a) : arena(&a) {}
+	template<typename U>
+	scratch_allocator(const scratch_allocator<U> & o) : arena(o.arena) {}
+
+	T * allocate(size_t n) {
+		return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+	}
+	void deallocate(T *, size_t) {}
+
+	template<typename U>
+	bool operator==(const scratch_allocator<U> & o) const { return arena == o.arena; }
+	template<typename U>
+	bool operator!=(const scratch_allocator<U> & o) const { return arena != o.arena; }
+
+	scratch_arena * arena;
+};
+
+template<typename T>
+using scratch_vector = std::vector<T, scratch_allocator<T>>;
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+namespace jd {
+
+// pad or align hot atomics to this, so two of them never share a cache line
+const size_t cache_line_size = 64;
+
+// cpu_relax -- hint to the core that we're in a spin loop.
+// On x86 this is PAUSE, which saves power and gives the SMT sibling the pipeline;
+// on ARM it's YIELD.  Elsewhere it's a no-op.
+inline void cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+	_mm_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+namespace jd {
+
+// task -- a move-only, type-erased void() callable, the unit of work a threadpool queues.
+// Callables up to inline_size bytes (and nothrow-movable) are stored inside the task itself,
+// so wrapping a small lambda doesn't allocate; bigger ones are moved to the heap.
+// Unlike std::function, the callable doesn't have to be copyable, so a task can own
+// a std::promise, a std::unique_ptr, etc.
+class task {
+public:
+	static const size_t inline_size = 64;
+
+	// stat_now() when a threadpool collecting stats queued this task; fits in what was padding
+	int64_t queued_at = 0;
+
+	task() : ops(nullptr) {}
+
+	template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type>
+	task(F && f) : ops(nullptr) {
+		typedef typename std::decay<F>::type Fn;
+		construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+	}
+
+	task(task && other) noexcept : queued_at(other.queued_at), ops(other.ops) {
+		if(ops) {
+			ops->move(storage, other.storage);
+			other.ops = nullptr;
+		}
+	}
+
+	task & operator=(task && other) noexcept {
+		if(this != &other) {
+			reset();
+			queued_at = other.queued_at;
+			if(other.ops) {
+				other.ops->move(storage, other.storage);
+				ops = other.ops;
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	task(const task&) = delete;
+	task & operator=(const task&) = delete;
+
+	~task() { reset(); }
+
+	explicit operator bool() const { return ops != nullptr; }
+
+	void operator()() { ops->invoke(storage); }
+
+	void reset() {
+		if(ops) {
+			ops->destroy(storage);
+			ops = nullptr;
+		}
+	}
+
+	// true if a callable of type F would be stored without allocating
+	template<typename F>
+	static constexpr bool fits_inline() {
+		return sizeof(F) <= inline_size
+			&& alignof(F) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<F>::value;
+	}
+
+private:
+	struct ops_table {
+		void (*invoke)(void * self);
+		void (*move)(void * dst, void * src);     // move-construct dst from src, then destroy src
+		void (*destroy)(void * self);
+	};
+
+	template<typename Fn>
+	struct inline_ops {
+		static Fn & get(void * p) { return *static_cast<Fn*>(p); }
+		static void invoke(void * self) { get(self)(); }
+		static void move(void * dst, void * src) {
+			::new(dst) Fn(std::move(get(src)));
+			get(src).~Fn();
+		}
+		static void destroy(void * self) { get(self).~Fn(); }
+		static const ops_table * table() {
+			static const ops_table t = { &invoke, &move, &destroy };
+			return &t;
+		}
+	};
+
+	template<typename Fn>
+	struct heap_ops {
+		static Fn *& get(void * p) { return *static_cast<Fn**>(p); }
+		static void invoke(void * self) { (*get(self))(); }
+		static void move(void * dst, void * src) { ::new(dst) Fn*(get(src)); }
+		static void destroy(void * self) { delete get(self); }
+		static const ops_table * table() {
+			static const ops_table t = { &invoke, &move, &destroy };
+			return &t;
+		}
+	};
+
+	template<typename Fn, typename F>
+	void construct(F && f, std::true_type /*inline*/) {
+		::new(static_cast<void*>(storage)) Fn(std::forward<F>(f));
+		ops = inline_ops<Fn>::table();
+	}
+
+	template<typename Fn, typename F>
+	void construct(F && f, std::false_type /*inline*/) {
+		::new(static_cast<void*>(storage)) Fn*(new Fn(std::forward<F>(f)));
+		ops = heap_ops<Fn>::table();
+	}
+
+	alignas(std::max_align_t) unsigned char storage[inline_size];
+	const ops_table * ops;
+};
+
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <jd/thread/threadpool.hpp>
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <cassert>
+
+namespace jd {
+
+// task_graph -- a fixed DAG of work, declared once and run as many times as you like.
+// Each node keeps a count of unfinished predecessors; a finishing node decrements its successors'
+// counts, runs the first one that hits zero itself, and queues the rest on the pool.  Nothing in
+// the graph blocks waiting on another node, and once the graph has run once (so the pool's queues
+// have grown to fit), running it again doesn't allocate.
+//
+// EXAMPLE:
+//   task_graph frame;
+//   int anim = frame.add_node( []{ UpdateAnimation(); } );
+//   int skin = frame.add_node( []{ UpdateSkinning(); } );
+//   int cull = frame.add_node( []{ Cull(); } );
+//   int draw = frame.add_node( []{ Submit(); } );
+//   frame.add_edge( anim, skin );
+//   frame.add_edge( skin, cull );
+//   frame.add_edge( cull, draw );
+//   ...
+//   frame.run( pool );    // every frame
+//
+// Node callables run once per run(); don't change the graph or start it again while it's running.
+class task_graph {
+	struct node {
+		task fn;
+		std::vector<int> successors;
+		int predecessor_count;
+		std::atomic<int> pending;   // predecessors not finished yet in the current run
+	};
+
+	std::vector<std::unique_ptr<node>> nodes;
+	std::vector<int> roots;
+	bool dirty;
+
+	threadpool * pool;
+	std::atomic<int> remaining;     // nodes not finished yet in the current run
+
+	std::mutex error_lock;
+	std::exception_ptr error;
+
+public:
+	task_graph() : dirty(false), pool(nullptr), remaining(0) {}
+
+	task_graph(const task_graph&) = delete;
+	task_graph& operator=(const task_graph&) = delete;
+
+	~task_graph() {
+		assert(done());
+	}
+
+	// returns the new node's id
+	int add_node(task fn) {
+		assert(done());
+		std::unique_ptr<node> n(new node);
+		n->fn = std::move(fn);
+		n->predecessor_count = 0;
+		n->pending.store(0, std::memory_order_relaxed);
+		nodes.push_back(std::move(n));
+		dirty = true;
+		return (int)nodes.size() - 1;
+	}
+
+	// `after` won't start until `before` has finished
+	void add_edge(int before, int after) {
+		assert(done());
+		assert(before >= 0 && before < (int)nodes.size() && after >= 0 && after < (int)nodes.size());
+		nodes[before]->successors.push_back(after);
+		nodes[after]->predecessor_count++;
+		dirty = true;
+	}
+
+	int size() const { return (int)nodes.size(); }
+
+	// true if the edges don't form a cycle (a cycle would never finish)
+	bool is_acyclic() const {
+		std::vector<int> count(nodes.size());
+		std::vector<int> ready;
+		for(size_t i = 0; i < nodes.size(); i++) {
+			count[i] = nodes[i]->predecessor_count;
+			if(count[i] == 0) {
+				ready.push_back((int)i);
+			}
+		}
+		size_t visited = 0;
+		while(!ready.empty()) {
+			int n = ready.back();
+			ready.pop_back();
+			visited++;
+			for(int s : nodes[n]->successors) {
+				if(--count[s] == 0) {
+					ready.push_back(s);
+				}
+			}
+		}
+		return visited == nodes.size();
+	}
+
+	// Kick off a run and return right away.  Call wait() (or poll done()) before running it again.
+	void start(threadpool & p) {
+		assert(done());
+		if(dirty) {
+			assert(is_acyclic());
+			roots.clear();
+			for(size_t i = 0; i < nodes.size(); i++) {
+				if(nodes[i]->predecessor_count == 0) {
+					roots.push_back((int)i);
+				}
+			}
+			dirty = false;
+		}
+		if(nodes.empty()) {
+			return;
+		}
+		pool = &p;
+		error = nullptr;
+		for(auto & n : nodes) {
+			n->pending.store(n->predecessor_count, std::memory_order_relaxed);
+		}
+		remaining.store((int)nodes.size(), std::memory_order_release);
+		for(int r : roots) {
+			schedule(r);
+		}
+	}
+
+	bool done() const { return remaining.load(std::memory_order_acquire) == 0; }
+
+	// Help the pool until the current run is finished, then rethrow the first exception a node threw.
+	void wait() {
+		if(!done()) {
+			pool->help_until([this]{ return done(); });
+		}
+		if(error) {
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+	void run(threadpool & p) {
+		start(p);
+		wait();
+	}
+
+private:
+	void schedule(int n) {
+		pool->add_task_unbounded(task([this, n]{ run_from(n); }));
+	}
+
+	// run node n, then keep going with one of the successors it made ready
+	void run_from(int n) {
+		while(n >= 0) {
+			node & nd = *nodes[n];
+			try {
+				nd.fn();
+			} catch(...) {
+				std::lock_guard<std::mutex> lock(error_lock);
+				if(!error) {
+					error = std::current_exception();
+				}
+			}
+			int next = -1;
+			for(int s : nd.successors) {
+				if(nodes[s]->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					if(next < 0) {
+						next = s;
+					} else {
+						schedule(s);
+					}
+				}
+			}
+			// last touch of the graph when this was the final node: after this, run() may return
+			remaining.fetch_sub(1, std::memory_order_acq_rel);
+			n = next;
+		}
+	}
+};
+
+}
@@ -1,10 +1,112 @@
 #include <cassert>
 #include <chrono>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <algorithm>
 #include "threadpool.hpp"
+#include "parallel.hpp"
+#include "mpmc_queue.hpp"
+#include "task_graph.hpp"
+#include "coro.hpp"
+#include "future.hpp"
+#include "topology.hpp"
+#include "timer_heap.hpp"
+#include "pipeline.hpp"
+#include "parallel_sort.hpp"
+#include "scratch.hpp"
+#include "mpsc_queue.hpp"
+#include "main_queue.h"
+#include "thread.h"
+#include <jd/base/Profile.h>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#if defined(__linux__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-using namespace workqueue;
+// Build: g++ -std=c++14 -I. -pthread jd/thread/test.cpp jd/thread/main_queue.cpp jd/base/Profile.cpp jd/base/Timing.cpp jd/base/assert.cpp
+// (from the repository root).  thread.cpp needs boost, so the IsMainThread() main_queue asks about is defined below.
 
-int main() {
+// count every heap allocation in the process, so tests can check a code path doesn't allocate
+static std::atomic<long> allocation_count(0);
+
+// (kept out of line, or gcc matches the inlined malloc/free against the library's new/delete and warns)
+#if defined(__GNUC__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+// Every form is replaced, nothrow and array ones included (std::stable_sort's buffer comes from nothrow new),
+// so nothing allocated by the runtime's own operator new ends up in our free(), which ASan reports as a mismatch.
+static void * counted_alloc(std::size_t bytes) noexcept {
+	allocation_count++;
+	return std::malloc(bytes ? bytes : 1);
+}
+TEST_NOINLINE void * operator new(std::size_t bytes) {
+	if(void * p = counted_alloc(bytes)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+TEST_NOINLINE void * operator new[](std::size_t bytes) {
+	if(void * p = counted_alloc(bytes)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+TEST_NOINLINE void * operator new(std::size_t bytes, const std::nothrow_t &) noexcept { return counted_alloc(bytes); }
+TEST_NOINLINE void * operator new[](std::size_t bytes, const std::nothrow_t &) noexcept { return counted_alloc(bytes); }
+TEST_NOINLINE void operator delete(void * p) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete(void * p, std::size_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p, std::size_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete(void * p, const std::nothrow_t &) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p, const std::nothrow_t &) noexcept { std::free(p); }
+#if defined(__cpp_aligned_new)
+static void * counted_alloc(std::size_t bytes, std::align_val_t align) noexcept {
+	allocation_count++;
+	const std::size_t a = (std::size_t)align;
+	return std::aligned_alloc(a, bytes ? (bytes + a - 1) / a * a : a);
+}
+TEST_NOINLINE void * operator new(std::size_t bytes, std::align_val_t align) {
+	if(void * p = counted_alloc(bytes, align)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+TEST_NOINLINE void * operator new[](std::size_t bytes, std::align_val_t align) {
+	if(void * p = counted_alloc(bytes, align)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+TEST_NOINLINE void * operator new(std::size_t bytes, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_alloc(bytes, align); }
+TEST_NOINLINE void * operator new[](std::size_t bytes, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_alloc(bytes, align); }
+TEST_NOINLINE void operator delete(void * p, std::align_val_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p, std::align_val_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete(void * p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete(void * p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+TEST_NOINLINE void operator delete[](void * p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+#endif
+
+static std::thread::id test_main_thread;
+
+bool IsMainThread() {
+	return std::this_thread::get_id() == test_main_thread;
+}
+
+using namespace jd;
+
+static void test_shared_queue() {
 	threadpool tp(1);
 
 	std::packaged_task<int()> task1([]{return 15;});
@@ -16,3 +118,1455 @@ int main() {
 	assert(fut.get() == 15);
 	assert(fut2.get() == 16);
 }
+
+static void test_work_stealing() {
+	threadpool_options opt;
+	opt.threads = 4;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool tp(opt);
+
+	// each outer task spawns inner tasks from inside a worker, which land on that worker's deque
+	std::atomic<int> done(0);
+	std::function<void()> inner = [&]{ done++; };
+	std::function<void()> outer = [&]{
+		assert(tp.current_worker() >= 0);
+		for(int i = 0; i < 100; i++) {
+			tp.add_task(inner);
+		}
+		done++;
+	};
+	for(int i = 0; i < 10; i++) {
+		tp.add_task(outer);
+	}
+	while(done < 10 * 101) {
+		std::this_thread::yield();
+	}
+	assert(tp.current_worker() == -1);
+}
+
+static void test_park_and_wake() {
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.idle_spin = 0;
+	opt.idle_yield = 0;
+	threadpool tp(opt);
+
+	// let both workers park, then make sure a submit still gets through
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	std::packaged_task<int()> task([]{return 17;});
+	auto fut = tp.add_task<int>(task);
+	assert(fut.get() == 17);
+}
+
+static void test_parallel_for() {
+	threadpool_options opt;
+	opt.threads = 3;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool tp(opt);
+
+	const int n = 100000;
+	std::vector<int> v(n, 0);
+	parallel_for(tp, 0, n, 1000, [&](int i){ v[i] += i; }, partitioner::static_chunks);
+	parallel_for(tp, 0, n, 333, [&](int i){ v[i] += i; }, partitioner::adaptive);
+	for(int i = 0; i < n; i++) {
+		assert(v[i] == 2 * i);
+	}
+
+	auto sum = [&](int b, int e, long long acc){ for(int i = b; i < e; i++) { acc += v[i]; } return acc; };
+	auto add = [](long long a, long long b){ return a + b; };
+	const long long expect = (long long)n * (n - 1);
+	assert(parallel_reduce(tp, 0, n, 1000, 0LL, sum, add, partitioner::static_chunks) == expect);
+	assert(parallel_reduce(tp, 0, n, 7, 0LL, sum, add, partitioner::adaptive) == expect);
+	assert(parallel_reduce(tp, 5, 5, 7, 0LL, sum, add) == 0);
+
+	// with the pool warmed up by the loops above, the shared chunk state is all a parallel_for allocates
+	const long before = allocation_count.load();
+	parallel_for(tp, 0, n, 1000, [&](int i){ v[i] -= i; }, partitioner::static_chunks);
+	parallel_for(tp, 0, n, 333, [&](int i){ v[i] -= i; }, partitioner::adaptive);
+	assert(allocation_count.load() - before == 2);
+	assert(v[n - 1] == 0);
+}
+
+static void test_move_only_task() {
+	threadpool tp(2);
+
+	// the pool owns the callable, which doesn't have to be copyable
+	std::unique_ptr<int> owned(new int(41));
+	auto fut = tp.add_task([p = std::move(owned)]{ return *p + 1; });
+	assert(fut.get() == 42);
+
+	auto thrower = tp.add_task([]() -> int { throw 7; });
+	bool caught = false;
+	try {
+		thrower.get();
+	} catch(int e) {
+		caught = (e == 7);
+	}
+	assert(caught);
+
+	// big callables still work, they just go to the heap
+	struct big { char pad[256]; int operator()() const { return pad[0]; } } b = {};
+	b.pad[0] = 3;
+	assert(tp.add_task(b).get() == 3);
+	assert(!task::fits_inline<big>());
+}
+
+static void test_task_submit_does_not_allocate() {
+	threadpool tp(1);
+	int x = 5;
+	auto small = [&x]{ return x; };
+	static_assert(task::fits_inline<detail::promise_call<decltype(small), int>>(), "small lambda should be stored inline");
+
+	// warm up the queue ring and the future block cache with more in flight than the measured
+	// rounds use, since a worker can still be releasing the last batch's state when the next one starts
+	std::vector<std::future<int>> futs;
+	futs.reserve(256);
+	for(int i = 0; i < 256; i++) {
+		futs.push_back(tp.add_task(small));
+	}
+	for(auto & f : futs) {
+		f.get();
+	}
+	futs.clear();
+
+	const long before = allocation_count.load();
+	for(int round = 0; round < 100; round++) {
+		for(int i = 0; i < 64; i++) {
+			futs.push_back(tp.add_task(small));
+		}
+		for(auto & f : futs) {
+			assert(f.get() == 5);
+		}
+		futs.clear();
+	}
+	assert(allocation_count.load() == before);
+}
+
+static void test_mpmc_queue() {
+	mpmc_queue<int> q(4);
+	assert(q.capacity() == 4);
+	int out = 0;
+	assert(!q.try_pop(out));
+	for(int i = 0; i < 4; i++) {
+		assert(q.try_push(int(i)));
+	}
+	assert(!q.try_push(99));
+	assert(q.try_pop(out) && out == 0);
+
+	int in[8] = { 10, 11, 12, 13, 14, 15, 16, 17 };
+	assert(q.try_push_batch(in, 8) == 1);   // only one cell free
+	int got[8];
+	assert(q.try_pop_batch(got, 8) == 4);
+	assert(got[0] == 1 && got[1] == 2 && got[2] == 3 && got[3] == 10);
+	assert(q.try_pop_batch(got, 8) == 0);
+
+	// producers and consumers hammering a small ring: every item comes out exactly once
+	mpmc_queue<int> ring(64);
+	const int producers = 4, per_producer = 20000;
+	std::atomic<long long> sum(0);
+	std::atomic<int> consumed(0);
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; p++) {
+		threads.push_back(std::thread([&, p]{
+			int batch[16];
+			for(int i = 0; i < per_producer; ) {
+				if(i % 3 == 0) {
+					int n = 0;
+					for(; n < 16 && i + n < per_producer; n++) {
+						batch[n] = p * per_producer + i + n + 1;
+					}
+					int sent = 0;
+					while(sent < n) {
+						size_t k = ring.try_push_batch(batch + sent, n - sent);
+						if(!k) {
+							std::this_thread::yield();
+						}
+						sent += (int)k;
+					}
+					i += n;
+				} else {
+					ring.push(p * per_producer + i + 1);
+					i++;
+				}
+			}
+		}));
+	}
+	for(int c = 0; c < 3; c++) {
+		threads.push_back(std::thread([&]{
+			int batch[8];
+			while(consumed.load() < producers * per_producer) {
+				size_t n = ring.try_pop_batch(batch, 8);
+				if(!n) {
+					std::this_thread::yield();
+				}
+				for(size_t i = 0; i < n; i++) {
+					sum += batch[i];
+				}
+				consumed += (int)n;
+			}
+		}));
+	}
+	for(auto & t : threads) {
+		t.join();
+	}
+	const long long total = producers * per_producer;
+	assert(sum.load() == total * (total + 1) / 2);
+}
+
+static void test_mpsc_queue() {
+	mpsc_queue<std::unique_ptr<int>> q;
+	std::unique_ptr<int> out;
+	assert(q.empty() && !q.try_pop(out));
+	q.push(std::unique_ptr<int>(new int(1)));
+	q.push(std::unique_ptr<int>(new int(2)));
+	assert(q.collect() == 2 && q.collected() == 2);
+	q.push(std::unique_ptr<int>(new int(3)));
+	// collected items come first; the newer push waits for the next collect
+	assert(q.try_pop(out) && *out == 1);
+	assert(q.try_pop(out) && *out == 2);
+	assert(q.collected() == 0 && !q.empty());
+	assert(q.try_pop(out) && *out == 3);
+	assert(q.empty());
+	q.push(std::unique_ptr<int>(new int(4)));  // freed by the destructor
+
+	// several producers: everything arrives once, each producer's items in order
+	const int producers = 3, per = 20000;
+	mpsc_queue<int> m;
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; p++) {
+		threads.emplace_back([&m, p]{
+			for(int i = 0; i < per; i++) {
+				m.push(p * per + i);
+			}
+		});
+	}
+	std::vector<int> last(producers, -1);
+	int got = 0, v = 0;
+	while(got < producers * per) {
+		if(!m.try_pop(v)) {
+			std::this_thread::yield();
+			continue;
+		}
+		assert(v % per == last[v / per] + 1);
+		last[v / per] = v % per;
+		got++;
+	}
+	for(auto & t : threads) {
+		t.join();
+	}
+	assert(m.empty());
+}
+
+static void test_main_queue() {
+	// oldest first, and a drain with time to spare runs everything
+	main_queue q;
+	std::vector<int> order;
+	assert(q.drain(1.0) == 0);
+	for(int i = 0; i < 5; i++) {
+		q.post([&order, i]{ order.push_back(i); });
+	}
+	assert(q.drain(1.0) == 5);
+	assert(order == std::vector<int>({0, 1, 2, 3, 4}) && q.empty());
+
+	// the budget cuts a drain short, but it always runs one; the rest go first next time, still in order
+	order.clear();
+	for(int i = 0; i < 10; i++) {
+		q.post([&order, i]{
+			order.push_back(i);
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		});
+	}
+	assert(q.drain(0) == 1);
+	q.post([&order]{ order.push_back(10); });
+	const int ran = q.drain(0.005);
+	assert(ran >= 1 && ran < 9);
+	while(!q.empty()) {
+		q.drain(1.0);
+	}
+	assert(order.size() == 11);
+	for(int i = 0; i < 11; i++) {
+		assert(order[i] == i);
+	}
+
+	// a callback that posts waits for the next drain, so one that reposts itself can't keep a drain going
+	int runs = 0;
+	std::function<void()> again = [&]{
+		if(++runs < 3) {
+			q.post(again);
+		}
+	};
+	q.post(again);
+	assert(q.drain(1.0) == 1 && runs == 1 && !q.empty());
+	assert(q.drain(1.0) == 1 && runs == 2);
+	assert(q.drain(1.0) == 1 && runs == 3 && q.empty());
+
+	// a throwing callback propagates, and what's behind it stays queued
+	order.clear();
+	q.post([]{ throw std::runtime_error("callback failed"); });
+	q.post([&order]{ order.push_back(1); });
+	bool threw = false;
+	try {
+		q.drain(1.0);
+	} catch(const std::runtime_error &) {
+		threw = true;
+	}
+	assert(threw && order.empty());
+	assert(q.drain(1.0) == 1 && order == std::vector<int>({1}));
+
+	// the process-wide queue, fed from pool workers and drained on the main thread
+	threadpool tp(2);
+	std::atomic<int> posted(0);
+	int sum = 0;
+	for(int i = 1; i <= 100; i++) {
+		tp.add_task([&posted, &sum, i]{
+			GetMainQueue().post([&sum, i]{ sum += i; });
+			posted++;
+		});
+	}
+	while(posted.load() < 100) {
+		std::this_thread::yield();
+	}
+	while(!GetMainQueue().empty()) {
+		GetMainQueue().drain(1.0);
+	}
+	assert(sum == 5050);
+}
+
+static void test_lock_free_pool_queue() {
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.queue = queue_impl::lock_free;
+	opt.lock_free_capacity = 8;   // small, so the locked overflow gets used too
+	threadpool tp(opt);
+	assert(tp.get_queue_impl() == queue_impl::lock_free);
+
+	std::vector<std::future<int>> futs;
+	for(int i = 0; i < 1000; i++) {
+		futs.push_back(tp.add_task([i]{ return i; }));
+	}
+	for(int i = 0; i < 1000; i++) {
+		assert(futs[i].get() == i);
+	}
+}
+
+static void test_task_graph() {
+	threadpool_options opt;
+	opt.threads = 3;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool tp(opt);
+
+	// diamond: a -> (b, c) -> d, plus e with no edges
+	std::atomic<int> a(0), b(0), c(0), d(0), e(0);
+	std::atomic<bool> ordered(true);
+	task_graph g;
+	int na = g.add_node([&]{ a++; });
+	int nb = g.add_node([&]{ if(b.load() + 1 != a.load()) { ordered = false; } b++; });
+	int nc = g.add_node([&]{ if(c.load() + 1 != a.load()) { ordered = false; } c++; });
+	int nd = g.add_node([&]{ if(b.load() != c.load() || d.load() + 1 != b.load()) { ordered = false; } d++; });
+	g.add_node([&]{ e++; });
+	g.add_edge(na, nb);
+	g.add_edge(na, nc);
+	g.add_edge(nb, nd);
+	g.add_edge(nc, nd);
+	assert(g.is_acyclic());
+
+	g.run(tp);
+	const long before = allocation_count.load();
+	for(int i = 1; i < 100; i++) {
+		g.run(tp);
+	}
+	assert(allocation_count.load() == before);
+	assert(ordered);
+	assert(a == 100 && b == 100 && c == 100 && d == 100 && e == 100);
+
+	task_graph cyclic;
+	int x = cyclic.add_node([]{});
+	int y = cyclic.add_node([]{});
+	cyclic.add_edge(x, y);
+	cyclic.add_edge(y, x);
+	assert(!cyclic.is_acyclic());
+}
+
+static void test_priority_lanes() {
+	// one worker, held busy while we queue up work, so the pop order is visible
+	threadpool_options opt;
+	opt.threads = 1;
+	opt.starvation_limit = 4;
+	threadpool tp(opt);
+
+	std::atomic<bool> release(false);
+	tp.add_task([&]{ while(!release) { std::this_thread::yield(); } });
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::mutex order_lock;
+	std::vector<char> order;
+	auto record = [&](char c){ return [&, c]{ std::lock_guard<std::mutex> lock(order_lock); order.push_back(c); }; };
+	std::vector<std::future<void>> futs;
+	for(int i = 0; i < 2; i++) {
+		futs.push_back(tp.add_task(task_priority::background, record('b')));
+	}
+	for(int i = 0; i < 10; i++) {
+		futs.push_back(tp.add_task(task_priority::normal, record('n')));
+	}
+	for(int i = 0; i < 10; i++) {
+		futs.push_back(tp.add_task(task_priority::critical, record('c')));
+	}
+	release = true;
+	for(auto & f : futs) {
+		f.get();
+	}
+
+	// critical first, but after starvation_limit pops that passed them over,
+	// the waiting normal and background tasks each get a turn
+	assert(order.size() == 22);
+	assert(std::count(order.begin(), order.begin() + 4, 'c') == 4);
+	assert(std::count(order.begin() + 4, order.begin() + 6, 'n') == 1);
+	assert(std::count(order.begin() + 4, order.begin() + 6, 'b') == 1);
+	assert(order.back() != 'c');
+
+	// a reserved worker picks up critical work while the other one is stuck
+	threadpool_options ropt;
+	ropt.threads = 2;
+	ropt.reserved_critical_workers = 1;
+	threadpool rtp(ropt);
+	std::atomic<bool> unblock(false);
+	auto blocker = rtp.add_task([&]{ while(!unblock) { std::this_thread::yield(); } });
+	auto crit = rtp.add_task(task_priority::critical, []{ return 5; });
+	assert(crit.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+	assert(crit.get() == 5);
+	unblock = true;
+	blocker.get();
+}
+
+static int fork_join_fib(threadpool & tp, int n) {
+	if(n < 2) {
+		return n;
+	}
+	jd::future<int> a = spawn(tp, [&tp, n]{ return fork_join_fib(tp, n - 1); });
+	int b = fork_join_fib(tp, n - 2);
+	return a.get() + b;
+}
+
+static void test_help_while_waiting() {
+	// with one worker, a task that blocked on its own subtask would hang forever
+	threadpool tp(1);
+	auto outer = tp.add_task([&tp]{
+		auto inner = tp.add_task([]{ return 20; });
+		wait_and_help(tp, inner);
+		return inner.get() + 1;
+	});
+	wait_and_help(tp, outer);
+	assert(outer.get() == 21);
+
+	auto fib = spawn(tp, [&tp]{ return fork_join_fib(tp, 15); });
+	assert(fib.get() == 610);
+
+	threadpool_options opt;
+	opt.threads = 3;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool stealing(opt);
+	assert(spawn(stealing, [&stealing]{ return fork_join_fib(stealing, 18); }).get() == 2584);
+}
+
+#if defined(__linux__)
+static void write_sysfs(const std::string & root, const std::string & path, const std::string & text) {
+	std::string dir = root;
+	const size_t last = path.rfind('/');
+	std::string rest = (last == std::string::npos) ? std::string() : path.substr(0, last);
+	mkdir(dir.c_str(), 0755);
+	for(size_t at = 0; at < rest.size(); ) {
+		size_t slash = rest.find('/', at);
+		if(slash == std::string::npos) {
+			slash = rest.size();
+		}
+		dir = root + "/" + rest.substr(0, slash);
+		mkdir(dir.c_str(), 0755);
+		at = slash + 1;
+	}
+	std::ofstream(root + "/" + path) << text << "\n";
+}
+#endif
+
+static void test_topology() {
+	assert(detail::parse_cpu_list("0-3,8,10-11") == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+
+#if defined(__linux__)
+	// 2 packages x 2 cores x 2 SMT threads; L2 per core, L3 per package; cpu n's sibling is n+4
+	const std::string root = "/tmp/jd_thread_test_topology." + std::to_string((long)getpid());
+	write_sysfs(root, "online", "0-7");
+	for(int id = 0; id < 8; id++) {
+		const int core = id % 4;
+		const int package = core / 2;
+		const std::string cpu = "cpu" + std::to_string(id);
+		write_sysfs(root, cpu + "/topology/physical_package_id", std::to_string(package));
+		write_sysfs(root, cpu + "/topology/core_id", std::to_string(core % 2));
+		write_sysfs(root, cpu + "/cache/index0/level", "1");
+		write_sysfs(root, cpu + "/cache/index0/type", "Instruction");
+		write_sysfs(root, cpu + "/cache/index0/shared_cpu_list", std::to_string(core) + "," + std::to_string(core + 4));
+		write_sysfs(root, cpu + "/cache/index1/level", "2");
+		write_sysfs(root, cpu + "/cache/index1/type", "Unified");
+		write_sysfs(root, cpu + "/cache/index1/shared_cpu_list", std::to_string(core) + "," + std::to_string(core + 4));
+		write_sysfs(root, cpu + "/cache/index2/level", "3");
+		write_sysfs(root, cpu + "/cache/index2/type", "Unified");
+		write_sysfs(root, cpu + "/cache/index2/shared_cpu_list", package ? "2-3,6-7" : "0-1,4-5");
+	}
+	cpu_topology topo = read_cpu_topology(root);
+	std::system(("rm -rf " + root).c_str());
+
+	assert(topo.logical() == 8 && topo.cores == 4 && topo.packages == 2 && topo.smt());
+	assert(topo.closeness(1, 5) == 3);  // SMT siblings
+	assert(topo.closeness(0, 1) == 1);  // same package, shared L3 only
+	assert(topo.closeness(0, 2) == 0);  // other package
+	// a core each, alternating packages, before any SMT sibling
+	assert(topo.spread_order() == std::vector<int>({0, 2, 1, 3, 4, 6, 5, 7}));
+
+	// an affinity mask (taskset, a cpuset cgroup) hides the cpus outside it
+	write_sysfs(root, "online", "0-7");
+	for(int id = 0; id < 8; id++) {
+		const std::string cpu = "cpu" + std::to_string(id);
+		write_sysfs(root, cpu + "/topology/physical_package_id", std::to_string((id % 4) / 2));
+		write_sysfs(root, cpu + "/topology/core_id", std::to_string(id % 2));
+	}
+	cpu_topology masked = read_cpu_topology(root, std::vector<int>({1, 2, 5, 6, 9}));
+	std::system(("rm -rf " + root).c_str());
+	assert(masked.logical() == 4 && masked.cores == 2 && masked.packages == 2);
+	assert(masked.spread_order() == std::vector<int>({1, 2, 5, 6}));
+	assert(!masked.find(0) && masked.find(5));
+
+	cpu_topology none = read_cpu_topology(root + ".missing", std::vector<int>({3, 7}));
+	assert(none.logical() == 2 && none.cpus[0].id == 3 && none.cpus[1].id == 7);
+#endif
+
+	// the real machine: sized by physical cores, pinned, and still runs everything
+	const cpu_topology & here = get_cpu_topology();
+	assert(here.cores >= 1 && here.logical() >= here.cores);
+	threadpool_options opt;
+	opt.use_physical_cores = true;
+	opt.pin_workers = true;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool tp(opt);
+	assert((int)tp.size() == here.cores);
+	std::atomic<int> sum(0);
+	parallel_for(tp, 0, 1000, 10, [&](int i){ sum += i; });
+	assert(sum == 999 * 1000 / 2);
+#if defined(__linux__)
+	// every cpu it picked is one this process may use
+	const std::vector<int> allowed = detail::affinity_cpus();
+	for(const cpu_topology::cpu & c : here.cpus) {
+		assert(std::find(allowed.begin(), allowed.end(), c.id) != allowed.end());
+	}
+	assert(tp.stats().pin_failures == 0);
+#endif
+}
+
+static void test_stats() {
+	histogram h;
+	assert(histogram::bucket_of(0) == 0 && histogram::bucket_of(1) == 1 && histogram::bucket_of(1000) == 10);
+
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.policy = schedule_policy::work_stealing;
+	opt.collect_stats = true;
+	threadpool tp(opt);
+	threadpool_stats before = tp.stats();
+
+	std::vector<std::future<void>> done;
+	for(int i = 0; i < 200; i++) {
+		done.push_back(tp.add_task([]{
+			auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+			while(std::chrono::steady_clock::now() < until) {
+			}
+		}));
+	}
+	for(auto & f : done) {
+		f.wait();
+	}
+	// a task's counters are recorded just after its future becomes ready
+	while(tp.stats().since(before).total().tasks < 200) {
+		std::this_thread::yield();
+	}
+	threadpool_stats d = tp.stats().since(before);
+	threadpool_stats::worker_stats all = d.total();
+	assert(d.workers.size() == 2);
+	assert(all.tasks == 200);
+	assert(all.running.count == 200 && all.queued.count == 200);
+	assert(all.depth.count >= 200 / threadpool_stats::depth_sample_rate);
+	assert(all.running.mean() >= 20000.0);          // ns
+	assert(all.running.percentile(0.5) >= 16383);   // the bucket holding 20us
+	assert(all.running.percentile(1.0) <= all.running.max);
+	assert(d.queue_depth == 0);
+
+	// run_one from outside lands in the outside slot
+	std::promise<void> gate;
+	std::shared_future<void> open = gate.get_future().share();
+	std::atomic<int> blocked(0);
+	for(int i = 0; i < 2; i++) {
+		tp.add_task([open, &blocked]{ blocked++; open.wait(); });
+	}
+	while(blocked < 2) {
+		std::this_thread::yield();
+	}
+	auto mine = tp.add_task([]{});
+	while(!tp.run_one()) {
+	}
+	gate.set_value();
+	mine.wait();
+	assert(tp.stats().outside.tasks == 1);
+
+	// off: nothing is counted
+	threadpool quiet(1);
+	quiet.add_task([]{}).wait();
+	assert(quiet.stats().total().tasks == 0);
+}
+
+static void test_elastic() {
+	threadpool_options opt;
+	opt.threads = 1;
+	opt.max_threads = 4;
+	opt.grow_latency = 0.001;
+	opt.idle_timeout = 0.05;
+	threadpool tp(opt);
+	assert(tp.size() == 1 && tp.max_size() == 4 && tp.is_elastic());
+
+	// four tasks that each wait for all four to be running: only finishes if the pool grows.
+	// There's no monitor thread, so a pool whose workers are all stuck grows on the next submit;
+	// the submits are spaced out past grow_latency for that.
+	std::atomic<int> running(0);
+	std::atomic<int> most(0);
+	std::vector<std::future<void>> done;
+	for(int i = 0; i < 4; i++) {
+		done.push_back(tp.add_task([&]{
+			running++;
+			auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while(running.load() < 4 && std::chrono::steady_clock::now() < until) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+			int n = running.load();
+			while(n > most.load()) {
+				most = n;
+			}
+		}));
+		std::this_thread::sleep_for(std::chrono::milliseconds(3));
+	}
+	for(auto & f : done) {
+		f.get();
+	}
+	assert(most == 4);
+	assert(tp.size() == 4);
+
+	// the extra workers retire once idle, and come back for the next burst
+	auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(tp.size() > 1 && std::chrono::steady_clock::now() < until) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	assert(tp.size() == 1);
+	running = 0;
+	most = 0;
+	done.clear();
+	for(int i = 0; i < 4; i++) {
+		done.push_back(tp.add_task([&]{
+			running++;
+			auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while(running.load() < 4 && std::chrono::steady_clock::now() < limit) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+		}));
+		std::this_thread::sleep_for(std::chrono::milliseconds(3));
+	}
+	for(auto & f : done) {
+		f.get();
+	}
+	assert(running == 4);
+}
+
+static void test_timers() {
+	timer_heap<int> heap;
+	timer_heap<int>::id a = heap.insert(3.0, 3);
+	timer_heap<int>::id b = heap.insert(1.0, 1);
+	heap.insert(2.0, 2);
+	assert(heap.size() == 3 && heap.next_due() == 1.0);
+	assert(heap.cancel(b) && !heap.cancel(b));
+	assert(heap.next_due() == 2.0);
+	timer_heap<int>::id t;
+	double when;
+	int * v;
+	assert(!heap.pop_due(1.5, t, when, v));
+	assert(heap.pop_due(2.5, t, when, v) && *v == 2 && when == 2.0);
+	assert(heap.rearm(t, 4.0) && heap.next_due() == 3.0);
+	assert(heap.pop_due(10.0, t, when, v) && t == a && *v == 3);
+	assert(heap.erase(a) && !heap.rearm(a, 5.0));
+	assert(heap.pop_due(10.0, t, when, v) && *v == 2 && when == 4.0);
+	heap.erase(t);
+	assert(heap.empty());
+
+	// workers park right away, so timers have to wake them
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.idle_spin = 0;
+	opt.idle_yield = 0;
+	threadpool tp(opt);
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+	std::atomic<int> order(0);
+	std::atomic<int> first(0), second(0);
+	const double t0 = tp.now();
+	tp.add_task_after(0.02, [&]{ second = ++order; });
+	tp.add_task_at(t0 + 0.01, [&]{ first = ++order; });
+	timer_id dropped = tp.add_task_after(0.01, [&]{ order += 100; });
+	assert(tp.pending_timers() == 3);
+	assert(tp.cancel_timer(dropped));
+	while(order.load() < 2) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	assert(tp.now() - t0 >= 0.02);
+	assert(first == 1 && second == 2);
+
+	std::atomic<int> ticks(0);
+	timer_id periodic = tp.add_periodic(0.005, [&]{ ticks++; });
+	while(ticks.load() < 3) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	assert(tp.cancel_timer(periodic) && !tp.cancel_timer(periodic));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	const int stopped = ticks.load();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	assert(ticks.load() == stopped && order == 2);
+	assert(tp.pending_timers() == 0);
+
+	// a periodic callback that throws stops its timer instead of taking the worker down
+	std::atomic<int> runs(0);
+	timer_id failing = tp.add_periodic(0.002, [&]{
+		if(++runs == 2) {
+			throw std::runtime_error("tick failed");
+		}
+	});
+	while(runs.load() < 2) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	assert(runs.load() == 2);
+	assert(tp.pending_timers() == 0 && !tp.cancel_timer(failing));
+	assert(tp.add_task([]{ return 7; }).get() == 7);
+}
+
+template<typename T>
+static bool was_cancelled(std::future<T> & f) {
+	try {
+		f.get();
+	} catch(const task_cancelled &) {
+		return true;
+	}
+	return false;
+}
+
+static void test_cancellation() {
+	threadpool tp(1);
+
+	// hold the only worker, so everything below is still queued when it's cancelled
+	std::promise<void> gate;
+	std::shared_future<void> open = gate.get_future().share();
+	auto blocker = tp.add_task([open]{ open.wait(); });
+
+	cancel_source frame;
+	task_options o;
+	o.token = frame.token();
+	std::atomic<int> ran(0);
+	std::vector<std::future<int>> dropped;
+	for(int i = 0; i < 8; i++) {
+		dropped.push_back(tp.add_task(o, [&ran, i]{ ran++; return i; }));
+	}
+	task_options late;
+	late.deadline = tp.now() + 0.005;
+	auto expired = tp.add_task(late, [&ran]{ ran++; });
+	task_options fine;
+	fine.deadline = tp.now() + 60.0;
+	auto kept = tp.add_task(fine, []{ return 7; });
+
+	frame.cancel();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	gate.set_value();
+	blocker.get();
+	for(auto & f : dropped) {
+		assert(was_cancelled(f));
+	}
+	assert(was_cancelled(expired));
+	assert(kept.get() == 7);
+	assert(ran == 0);
+
+	// a running task sees its own cancellation, and nothing outside a cancellable task is ever cancelled
+	assert(!this_task::cancelled());
+	cancel_source stop;
+	task_options watched;
+	watched.token = stop.token();
+	std::atomic<bool> started(false);
+	auto loop = tp.add_task(watched, [&started]{
+		started = true;
+		int steps = 0;
+		while(!this_task::cancelled()) {
+			std::this_thread::yield();
+			steps++;
+		}
+		return steps;
+	});
+	while(!started) {
+		std::this_thread::yield();
+	}
+	stop.cancel();
+	assert(loop.get() >= 0);
+	assert(!cancel_token().is_cancelled() && stop.token().is_cancelled());
+
+	// a cancellable submit of a small lambda stays inline, and allocates nothing once the pool is warm
+	int x = 5;
+	auto small = [&x]{ return x; };
+	static_assert(task::fits_inline<detail::cancellable_call<decltype(small), int>>(), "cancellable small lambda should be stored inline");
+	cancel_source live;
+	task_options lo;
+	lo.token = live.token();
+	lo.deadline = tp.now() + 3600;
+	std::vector<std::future<int>> futs;
+	futs.reserve(256);
+	for(int i = 0; i < 256; i++) {
+		futs.push_back(tp.add_task(lo, small));
+	}
+	for(auto & f : futs) {
+		f.get();
+	}
+	futs.clear();
+	const long before = allocation_count.load();
+	for(int round = 0; round < 100; round++) {
+		for(int i = 0; i < 64; i++) {
+			futs.push_back(tp.add_task(lo, small));
+		}
+		for(auto & f : futs) {
+			assert(f.get() == 5);
+		}
+		futs.clear();
+	}
+	assert(allocation_count.load() == before);
+}
+
+static void test_bulk_submit() {
+	const int n = 1000;
+	std::atomic<int> sum(0);
+	auto check = [&](threadpool & tp, task_priority pri) {
+		sum = 0;
+		std::vector<task> batch;
+		for(int i = 1; i <= n; i++) {
+			batch.push_back(task([&sum, i]{ sum += i; }));
+		}
+		tp.add_tasks(batch, pri);
+		while(sum.load() < n * (n + 1) / 2) {
+			tp.run_one();
+		}
+		assert(sum == n * (n + 1) / 2);
+	};
+
+	threadpool shared(2);
+	check(shared, task_priority::normal);
+	check(shared, task_priority::background);
+
+	threadpool_options opt;
+	opt.threads = 2;
+	opt.queue = queue_impl::lock_free;
+	opt.lock_free_capacity = 64;    // smaller than the batch, so part of it spills
+	threadpool lock_free(opt);
+	check(lock_free, task_priority::normal);
+
+	// from inside a worker, the batch lands on its own deque and the others steal it
+	opt = threadpool_options();
+	opt.threads = 3;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool stealing(opt);
+	sum = 0;
+	stealing.add_task([&]{
+		std::vector<std::function<void()>> batch;
+		for(int i = 1; i <= n; i++) {
+			batch.push_back([&sum, i]{ sum += i; });
+		}
+		stealing.add_tasks(batch.begin(), batch.end());
+	}).get();
+	while(sum.load() < n * (n + 1) / 2) {
+		stealing.run_one();
+	}
+}
+
+static void test_bounded_queue() {
+	// one worker held on a gate, so the queue only drains when the test says so
+	auto bounded = [](overflow_policy how) {
+		threadpool_options opt;
+		opt.threads = 1;
+		opt.capacity = 4;
+		opt.overflow = how;
+		return opt;
+	};
+
+	{
+		threadpool tp(bounded(overflow_policy::reject));
+		std::promise<void> gate;
+		std::shared_future<void> open = gate.get_future().share();
+		std::atomic<bool> started(false);
+		tp.add_task([open, &started]{ started = true; open.wait(); });
+		while(!started) {
+			std::this_thread::yield();
+		}
+		for(int i = 0; i < 4; i++) {
+			assert(tp.try_add_task([]{ return 1; }).valid());
+		}
+		assert(!tp.try_add_task([]{ return 1; }).valid());
+		assert(!tp.try_add_task(task([]{})));
+		bool threw = false;
+		try {
+			tp.add_task([]{});
+		} catch(const queue_full &) {
+			threw = true;
+		}
+		assert(threw);
+		threadpool_stats s = tp.stats();
+		assert(s.rejected == 3 && s.blocked == 0 && s.ran_inline == 0);
+		gate.set_value();
+	}
+
+	{
+		threadpool tp(bounded(overflow_policy::run_inline));
+		std::promise<void> gate;
+		std::shared_future<void> open = gate.get_future().share();
+		std::atomic<bool> started(false);
+		tp.add_task([open, &started]{ started = true; open.wait(); });
+		while(!started) {
+			std::this_thread::yield();
+		}
+		for(int i = 0; i < 4; i++) {
+			tp.add_task([]{});
+		}
+		std::thread::id ran_on;
+		auto inline_run = tp.add_task([&ran_on]{ ran_on = std::this_thread::get_id(); return 5; });
+		assert(inline_run.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+		assert(inline_run.get() == 5 && ran_on == std::this_thread::get_id());
+		assert(tp.stats().ran_inline == 1);
+		gate.set_value();
+	}
+
+	{
+		threadpool tp(bounded(overflow_policy::block));
+		std::promise<void> gate;
+		std::shared_future<void> open = gate.get_future().share();
+		std::atomic<bool> started(false);
+		tp.add_task([open, &started]{ started = true; open.wait(); });
+		while(!started) {
+			std::this_thread::yield();
+		}
+		std::atomic<int> done(0);
+		for(int i = 0; i < 4; i++) {
+			tp.add_task([&done]{ done++; });
+		}
+		std::atomic<bool> producer_done(false);
+		std::thread producer([&]{
+			tp.add_task([&done]{ done++; });  // blocks until the worker frees a slot
+			producer_done = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		assert(!producer_done);
+		gate.set_value();
+		producer.join();
+		while(done.load() < 5) {
+			std::this_thread::yield();
+		}
+		threadpool_stats s = tp.stats();
+		assert(s.blocked == 1 && s.blocked_ns > 0);
+	}
+
+	{
+		// jd/thread's own tasks aren't subject to the overflow policy, even on a tiny rejecting pool
+		threadpool_options opt = bounded(overflow_policy::reject);
+		opt.threads = 2;
+		opt.capacity = 2;
+		threadpool tp(opt);
+
+		const int n = 10000;
+		std::vector<int> v(n, 0);
+		parallel_for(tp, 0, n, 10, [&](int i){ v[i] += 1; }, partitioner::static_chunks);
+		parallel_for(tp, 0, n, 10, [&](int i){ v[i] += 1; }, partitioner::adaptive);
+		for(int i = 0; i < n; i++) {
+			assert(v[i] == 2);
+		}
+
+		std::atomic<int> ran(0);
+		task_graph g;
+		const int root = g.add_node([&]{ ran++; });
+		for(int i = 0; i < 50; i++) {
+			g.add_edge(root, g.add_node([&]{ ran++; }));
+		}
+		g.run(tp);
+		assert(ran == 51);
+
+		pipeline<int> p(8);
+		std::atomic<long long> sum(0);
+		p.add_stage(stage_mode::parallel, [](int & x) { x *= 2; });
+		p.add_stage(stage_mode::serial_in_order, [&](int & x) { sum += x; });
+		int produced = 0;
+		p.run(tp, [&](int & x) {
+			if(produced == 1000) {
+				return false;
+			}
+			x = produced++;
+			return true;
+		});
+		assert(sum == 999LL * 1000);
+
+		assert(tp.stats().rejected == 0);
+	}
+}
+
+static void test_pipeline() {
+	struct item {
+		int in;
+		long long out;
+	};
+	const int n = 5000, window = 8;
+
+	auto check = [&](threadpool & tp) {
+		pipeline<item> p(window);
+		std::atomic<int> live(0), most(0);
+		std::vector<int> in_order;
+		long long unordered_sum = 0;
+		int produced = 0;
+		p.add_stage(stage_mode::parallel, [&](item & it) {
+			int l = ++live;
+			while(l > most.load()) {
+				most = l;
+			}
+			it.out = (long long)it.in * it.in;
+		});
+		p.add_stage(stage_mode::serial_out_of_order, [&](item & it) { unordered_sum += it.out; });
+		p.add_stage(stage_mode::serial_in_order, [&](item & it) {
+			in_order.push_back(it.in);
+			live--;
+		});
+		p.run(tp, [&](item & it) {
+			if(produced == n) {
+				return false;
+			}
+			it.in = produced++;
+			it.out = 0;
+			return true;
+		});
+		assert(p.done());
+		assert((int)in_order.size() == n);
+		for(int i = 0; i < n; i++) {
+			assert(in_order[i] == i);
+		}
+		long long expect = 0;
+		for(long long i = 0; i < n; i++) {
+			expect += i * i;
+		}
+		assert(unordered_sum == expect);
+		assert(most.load() <= window);
+
+		// the same pipeline runs again, and a throwing stage stops it
+		produced = 0;
+		bool threw = false;
+		try {
+			p.run(tp, [&](item & it) {
+				it.in = produced++;
+				if(it.in == 100) {
+					throw 42;
+				}
+				return true;   // unbounded: only the throw ends it
+			});
+		} catch(int e) {
+			threw = (e == 42);
+		}
+		assert(threw && p.done());
+	};
+
+	threadpool one(1);
+	check(one);
+	threadpool_options opt;
+	opt.threads = 3;
+	opt.policy = schedule_policy::work_stealing;
+	threadpool stealing(opt);
+	check(stealing);
+}
+
+static void test_parallel_sort_and_scan() {
+	threadpool tp(3);
+
+	// big enough to be cut into chunks and merged, with duplicates and a run of negatives
+	const int n = 200003;
+	std::vector<float> v(n);
+	uint32_t seed = 12345;
+	for(int i = 0; i < n; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		v[i] = (float)((int)(seed >> 16) % 2000 - 1000) * 0.25f;
+	}
+	v[7] = -0.0f;
+	std::vector<float> expect = v;
+	std::sort(expect.begin(), expect.end());
+
+	std::vector<float> a = v;
+	parallel_sort(tp, a.begin(), a.end());
+	assert(a == expect);
+
+	std::vector<float> r = v;
+	parallel_radix_sort(tp, &r[0], &r[0] + n);
+	for(int i = 1; i < n; i++) {
+		assert(!(r[i] < r[i - 1]));
+	}
+
+	std::vector<float> d = v;
+	parallel_sort(tp, d.begin(), d.end(), [](float x, float y){ return x > y; });
+	assert(std::equal(d.begin(), d.end(), expect.rbegin()));
+
+	// stability: sort (key, index) pairs by key alone, both ways; equal keys keep their index order
+	std::vector<std::pair<int, int>> p(n);
+	for(int i = 0; i < n; i++) {
+		p[i] = std::make_pair((int)(v[i] * 4.0f) - 100 * (i & 1), i);
+	}
+	std::vector<std::pair<int, int>> p2 = p;
+	parallel_stable_sort(tp, p.begin(), p.end(), [](const std::pair<int, int> & x, const std::pair<int, int> & y){ return x.first < y.first; });
+	parallel_radix_sort(tp, &p2[0], &p2[0] + n, [](const std::pair<int, int> & x){ return (int32_t)x.first; });
+	assert(p == p2);
+	for(int i = 1; i < n; i++) {
+		assert(p[i - 1].first < p[i].first || (p[i - 1].first == p[i].first && p[i - 1].second < p[i].second));
+	}
+
+	// 64-bit keys, including ones only the top digits tell apart
+	std::vector<int64_t> w(n);
+	for(int i = 0; i < n; i++) {
+		w[i] = ((int64_t)(n - i) << 40) * ((i % 3) ? 1 : -1) + i % 5;
+	}
+	std::vector<int64_t> wexpect = w;
+	std::sort(wexpect.begin(), wexpect.end());
+	parallel_radix_sort(tp, &w[0], &w[0] + n);
+	assert(w == wexpect);
+
+	// small ranges and a pool with no workers take the serial paths
+	threadpool none(0);
+	std::vector<float> small(v.begin(), v.begin() + 100);
+	std::vector<float> sorted_small = small;
+	std::sort(sorted_small.begin(), sorted_small.end());
+	parallel_sort(tp, small.begin(), small.end());
+	assert(small == sorted_small);
+	std::vector<float> z = v;
+	parallel_sort(none, z.begin(), z.end());
+	assert(z == expect);
+
+	// scans, against the serial definition, including in place
+	std::vector<long long> in(n), inc(n), exc(n);
+	for(int i = 0; i < n; i++) {
+		in[i] = i % 17 - 3;
+	}
+	assert(parallel_inclusive_scan(tp, in.begin(), in.end(), inc.begin(), 1000) == inc.end());
+	parallel_exclusive_scan(tp, in.begin(), in.end(), exc.begin(), 777, 10LL);
+	long long run = 0;
+	for(int i = 0; i < n; i++) {
+		assert(exc[i] == 10 + run);
+		run += in[i];
+		assert(inc[i] == run);
+	}
+	std::vector<long long> inplace = in;
+	parallel_inclusive_scan(tp, inplace.begin(), inplace.end(), inplace.begin(), 4096,
+	                        [](long long x, long long y){ return x > y ? x : y; });
+	long long best = in[0];
+	for(int i = 0; i < n; i++) {
+		best = std::max(best, in[i]);
+		assert(inplace[i] == best);
+	}
+	inplace = in;
+	parallel_exclusive_scan(tp, inplace.begin(), inplace.end(), inplace.begin(), 5000, 0LL);
+	assert(inplace[n - 1] == run - in[n - 1]);
+	std::vector<int> one(1, 5), out(1);
+	parallel_inclusive_scan(tp, one.begin(), one.end(), out.begin(), 16);
+	assert(out[0] == 5);
+}
+
+static void test_scratch() {
+	scratch_arena a;
+	assert(a.capacity() == 0 && a.in_use() == 0);
+	char * c = static_cast<char *>(a.allocate(3, 1));
+	double * d = static_cast<double *>(a.allocate(sizeof(double), alignof(double)));
+	assert(((uintptr_t)d % alignof(double)) == 0 && (char *)d > c);
+	const scratch_arena::mark m = a.get_mark();
+	void * big = a.allocate(3 * scratch_arena::min_block);    // doesn't fit the first block
+	assert(big && a.capacity() > 3 * scratch_arena::min_block);
+	a.rewind(m);
+	assert(a.allocate(sizeof(double), alignof(double)) == (void *)(d + 1));
+	a.reset();
+	// winding back to empty folds the blocks into one, so the same load fits without growing again
+	const size_t held = a.capacity();
+	a.allocate(3, 1);
+	a.allocate(sizeof(double), alignof(double));
+	a.allocate(3 * scratch_arena::min_block);
+	assert(a.capacity() == held);
+	a.reset();
+	{
+		scratch_scope s(a);
+		a.allocate(100);
+	}
+	assert(a.in_use() == 0);
+
+	// tasks get their worker's arena back empty, even when one task runs others while it waits
+	threadpool tp(2);
+	std::atomic<int> dirty(0);
+	auto sort_some = [&dirty](int n) {
+		if(this_worker::scratch().in_use() != 0) {
+			dirty++;
+		}
+		scratch_vector<int> v;
+		for(int i = 0; i < n; i++) {
+			v.push_back((i * 7919) % n);
+		}
+		std::sort(v.begin(), v.end());
+		return v[n / 2];
+	};
+	std::vector<std::future<int>> futs;
+	for(int i = 0; i < 200; i++) {
+		futs.push_back(tp.add_task([&, i]{ return sort_some(100 + i); }));
+	}
+	for(auto & f : futs) {
+		f.get();
+	}
+	assert(dirty.load() == 0);
+
+	auto outer = tp.add_task([&]{
+		scratch_vector<int> mine(1000, 1);
+		auto inner = tp.add_task([&]{ return sort_some(5000); });
+		wait_and_help(tp, inner);
+		inner.get();
+		scratch_vector<int> more(1000, 2);  // the inner task, if it ran here, gave its memory back under ours
+		int sum = 0;
+		for(int i = 0; i < 1000; i++) {
+			sum += mine[i] + more[i];
+		}
+		return sum;
+	});
+	wait_and_help(tp, outer);
+	assert(outer.get() == 3000);
+
+	// once the arena has grown, scratch containers don't touch operator new
+	const long before = allocation_count.load();
+	for(int round = 0; round < 10; round++) {
+		scratch_scope s;
+		sort_some(2000);
+		scratch_vector<int> v(5000, 1);
+	}
+	assert(this_worker::scratch().in_use() == 0);
+	assert(allocation_count.load() == before);
+}
+
+static std::string read_file(const std::string & path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string & path, const std::string & data) {
+	std::ofstream(path, std::ios::binary) << data;
+}
+
+static size_t count_of(const std::string & text, const std::string & what) {
+	size_t n = 0;
+	for(size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1)) {
+		n++;
+	}
+	return n;
+}
+
+static void put_varint(std::string & out, unsigned long long v) {
+	while(v >= 0x80) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+static void test_profile() {
+#if defined(__linux__)
+	const std::string path = "/tmp/jd_thread_test_profile." + std::to_string((long)getpid());
+#else
+	const std::string path = "jd_thread_test_profile";
+#endif
+	TimeSystemInit();
+
+	// a full ring drops whole zones, nested ones included, and keeps room for the ends of the open ones.
+	// The main thread keeps its ring for good, so the small one doesn't get handed to the threads below.
+	ProfileSystemInit(16);
+	const int64 dropped_before = ProfileDroppedZones();
+	{
+		JD_PROFILE_SCOPE("frame");
+		for(int i = 0; i < 10; i++) {
+			JD_PROFILE_SCOPE("update");
+			JD_PROFILE_SCOPE("integrate");
+		}
+	}
+	const int kept = ProfileFlush();
+	const int64 dropped = ProfileDroppedZones() - dropped_before;
+	assert(kept <= 16 && kept % 2 == 0 && dropped > 0);
+	assert(kept / 2 + dropped == 21);
+	// once flushed there's room again
+	{ JD_PROFILE_SCOPE("frame"); }
+	assert(ProfileFlush() == 2 && ProfileDroppedZones() - dropped_before == dropped);
+	ProfileSystemInit(0);
+	ProfileClear();
+
+	// each thread records into its own ring, and one flush collects them all
+	static const char * const thread_names[3] = { "worker 0", "worker 1", "worker 2" };
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 3; t++) {
+		threads.emplace_back([t]{
+			ProfileSetThreadName(thread_names[t]);
+			for(int i = 0; i < 50; i++) {
+				JD_PROFILE_SCOPE("job");
+				JD_PROFILE_SCOPE(t == 1 ? "job \"quoted\"" : "step");
+			}
+		});
+	}
+	for(std::thread & th : threads) {
+		th.join();
+	}
+	assert(ProfileFlush() == 3 * 50 * 4);
+	assert(ProfileFlush() == 0);
+
+	// the Chrome export: thread names as metadata, then balanced begin/end pairs
+	assert(ProfileWriteChromeTrace((path + ".json").c_str()));
+	const std::string json = read_file(path + ".json");
+	assert(json.compare(0, 2, "{\"") == 0 && json.find("\"traceEvents\":[") != std::string::npos);
+	assert(count_of(json, "\"thread_name\"") == 3);
+	for(const char * name : thread_names) {
+		assert(json.find(std::string("\"") + name + "\"") != std::string::npos);
+	}
+	assert(count_of(json, "\"ph\":\"B\"") == 300 && count_of(json, "\"ph\":\"E\"") == 300);
+	assert(count_of(json, "\"name\":\"job\"") == 150 && count_of(json, "\"name\":\"step\"") == 100);
+	assert(count_of(json, "\"name\":\"job \\\"quoted\\\"\"") == 50);
+
+	// the binary form reads back into the same trace
+	assert(ProfileWriteBinary((path + ".bin").c_str()));
+	ProfileClear();
+	assert(ProfileReadBinary((path + ".bin").c_str()));
+	assert(ProfileWriteChromeTrace((path + ".json").c_str()));
+	assert(read_file(path + ".json") == json);
+
+	// and anything damaged is refused, leaving the trace alone
+	const std::string good = read_file(path + ".bin");
+	const std::string header = good.substr(0, 24);     // magic, seconds per tick, base ticks
+	std::string bad = good;
+	bad[3] = 'X';
+	write_file(path + ".bad", bad);
+	assert(!ProfileReadBinary((path + ".bad").c_str()));
+	for(size_t size = 0; size < good.size(); size += (size < 64 ? 1 : 37)) {
+		write_file(path + ".bad", good.substr(0, size));
+		assert(!ProfileReadBinary((path + ".bad").c_str()));
+	}
+	// a name count the file can't hold
+	bad = header;
+	put_varint(bad, 1ull << 60);
+	write_file(path + ".bad", bad);
+	assert(!ProfileReadBinary((path + ".bad").c_str()));
+	// an event count the file can't hold
+	bad = header;
+	put_varint(bad, 0);     // names
+	put_varint(bad, 1);     // threads
+	put_varint(bad, 7);     // id
+	put_varint(bad, 0);     // thread name
+	put_varint(bad, 1ull << 40);
+	write_file(path + ".bad", bad);
+	assert(!ProfileReadBinary((path + ".bad").c_str()));
+	// a name index past the table
+	bad = header;
+	put_varint(bad, 1);
+	put_varint(bad, 1);
+	bad += "z";
+	put_varint(bad, 1);
+	put_varint(bad, 7);
+	put_varint(bad, 0);
+	put_varint(bad, 1);
+	put_varint(bad, 2);     // names are stored plus one: 1 is "z", 2 is past it
+	put_varint(bad, 0);
+	write_file(path + ".bad", bad);
+	assert(!ProfileReadBinary((path + ".bad").c_str()));
+	bad[bad.size() - 2] = 1;
+	write_file(path + ".bad", bad);
+	assert(ProfileReadBinary((path + ".bad").c_str()));
+	assert(!ProfileReadBinary((path + ".missing").c_str()));
+
+	assert(ProfileReadBinary((path + ".bin").c_str()));
+	assert(ProfileWriteChromeTrace((path + ".json").c_str()));
+	assert(read_file(path + ".json") == json);
+	std::remove((path + ".json").c_str());
+	std::remove((path + ".bin").c_str());
+	std::remove((path + ".bad").c_str());
+	ProfileSystemShutdown();
+}
+
+#if JD_THREAD_COROUTINES
+static coro::task<int> coro_square(threadpool & tp, int x) {
+	co_await tp.schedule();
+	co_return x * x;
+}
+
+static coro::task<void> coro_fail(threadpool & tp) {
+	co_await tp.schedule();
+	throw 9;
+}
+
+static coro::task<int> coro_sum_of_squares(threadpool & tp, int n) {
+	std::vector<coro::task<int>> parts;
+	for(int i = 1; i <= n; i++) {
+		parts.push_back(coro_square(tp, i));
+	}
+	std::vector<int> squares = co_await coro::when_all(std::move(parts));
+	int sum = 0;
+	for(int s : squares) {
+		sum += s;
+	}
+	co_return sum;
+}
+
+static void test_coroutines() {
+	// one worker: nested waits have to suspend rather than block, or this never finishes
+	threadpool tp(1);
+	assert(coro::sync_wait(tp, coro_sum_of_squares(tp, 10)) == 385);
+
+	auto both = coro::sync_wait(tp, coro::when_all(coro_square(tp, 3), coro_sum_of_squares(tp, 3)));
+	assert(std::get<0>(both) == 9 && std::get<1>(both) == 14);
+
+	bool caught = false;
+	try {
+		coro::sync_wait(tp, coro_fail(tp));
+	} catch(int e) {
+		caught = (e == 9);
+	}
+	assert(caught);
+}
+#endif
+
+int main() {
+	test_main_thread = std::this_thread::get_id();
+
+	test_shared_queue();
+	test_work_stealing();
+	test_park_and_wake();
+	test_parallel_for();
+	test_move_only_task();
+	test_task_submit_does_not_allocate();
+	test_mpmc_queue();
+	test_mpsc_queue();
+	test_main_queue();
+	test_lock_free_pool_queue();
+	test_task_graph();
+	test_priority_lanes();
+	test_help_while_waiting();
+	test_topology();
+	test_stats();
+	test_elastic();
+	test_timers();
+	test_cancellation();
+	test_bulk_submit();
+	test_bounded_queue();
+	test_pipeline();
+	test_parallel_sort_and_scan();
+	test_scratch();
+	test_profile();
+#if JD_THREAD_COROUTINES
+	test_coroutines();
+#endif
+}
@@ -6,6 +6,7 @@
 
 #include "stdafx.h"
 #include <jd/thread/thread.h>
+#include <jd/thread/topology.hpp>
 //#include <boost/thread/thread.hpp>
 
 using namespace std;
@@ -18,6 +19,11 @@ int GetHardwareThreadCount()
 	return (int)boost::thread::hardware_concurrency();
 }
 
+int GetPhysicalCoreCount()
+{
+	return jd::get_cpu_topology().cores;
+}
+
 bool IsMainThread()
 {
     return boost::this_thread::get_id() == main_thread_id;
@@ -1,6 +1,7 @@
 #pragma once
 
 int GetHardwareThreadCount();
+int GetPhysicalCoreCount();     // SMT siblings count once; see jd/thread/topology.hpp
 
 bool IsMainThread();
 
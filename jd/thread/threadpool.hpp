@@ -2,76 +2,1182 @@
 
 #include <future>
 #include <thread>
-#include <deque>
 #include <vector>
+#include <memory>
+#include <atomic>
 #include <utility>
 #include <chrono>
 #include <functional>
 #include <type_traits>
+#include <algorithm>
+#include <limits>
+#include <iterator>
+#include <stdexcept>
+
+// co_await pool.schedule() and jd/thread/coro.hpp need C++20 coroutines
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define JD_THREAD_COROUTINES 1
+#else
+#define JD_THREAD_COROUTINES 0
+#endif
+
+#include <jd/thread/task.hpp>
+#include <jd/thread/block_cache.hpp>
+#include <jd/thread/work_deque.hpp>
+#include <jd/thread/mpmc_queue.hpp>
+#include <jd/thread/spin.hpp>
+#include <jd/thread/topology.hpp>
+#include <jd/thread/pool_stats.hpp>
+#include <jd/thread/timer_heap.hpp>
+#include <jd/thread/cancel.hpp>
+#include <jd/thread/scratch.hpp>
 
 namespace jd {
 
+// shared_queue: every task goes through one deque behind one lock (the original behavior).
+// work_stealing: each worker owns a deque; tasks added from inside a worker go to its own deque,
+//   tasks added from outside go to the shared deque, and idle workers steal from each other.
+enum class schedule_policy {
+	shared_queue,
+	work_stealing,
+};
+
+// What backs the shared queue.
+// locked: a ring_buffer behind the pool's access mutex.
+// lock_free: an mpmc_queue of lock_free_capacity entries; pushes and pops are a CAS each.
+//   If it fills up, further pushes spill into the locked ring, so add_task never blocks or fails.
+//   FIFO order holds within each of the two, not across them.
+enum class queue_impl {
+	locked,
+	lock_free,
+};
+
+// Priority lanes.  Workers take critical work first, then normal, then background,
+// except that a lane passed over starvation_limit times in a row (while it had work waiting)
+// goes first once, so a flood of high-priority work slows lower lanes down without stopping them.
+// Only normal tasks use the worker-local deques and the lock_free queue; the other lanes are locked rings.
+// The first reserved_critical_workers workers only ever run critical tasks, so critical work has
+// somewhere to go even when every other worker is busy with something long.
+enum class task_priority {
+	critical,
+	normal,
+	background,
+};
+const int task_priority_count = 3;
+
+// What add_task does when a bounded pool (threadpool_options::capacity) is full.
+// block: wait for a worker to take something off the queue.
+// reject: throw queue_full.
+// run_inline: run the task on the calling thread, right away.
+// try_add_task fails fast whatever the policy.  Submits from the pool's own workers never block,
+// since every worker waiting on the queue would deadlock it; under block they run inline instead.
+enum class overflow_policy {
+	block,
+	reject,
+	run_inline,
+};
+
+struct queue_full : std::runtime_error {
+	queue_full() : std::runtime_error("jd::threadpool queue is full") {}
+};
+
+// Idle workers poll for idle_spin rounds (with cpu_relax), then yield idle_yield times,
+// then park on the pool's condition variable until a submit or shutdown wakes them.
+// Spinning buys submit-to-start latency with CPU time; set both to 0 to park right away.
+struct threadpool_options {
+	int threads = 1;
+	schedule_policy policy = schedule_policy::shared_queue;
+	int idle_spin = 2000;
+	int idle_yield = 16;
+	queue_impl queue = queue_impl::locked;
+	size_t lock_free_capacity = 4096;
+	int reserved_critical_workers = 0;
+	int starvation_limit = 32;
+
+	// use_physical_cores: ignore threads and start one worker per physical core (SMT siblings don't count).
+	// pin_workers: pin worker i to the i-th cpu of cpu_topology::spread_order(), and have thieves
+	//   try victims that share a cache with them before the rest.  Failed pins show up in stats().pin_failures.
+	// Both only see the cpus in the process's affinity mask (see get_cpu_topology()).
+	bool use_physical_cores = false;
+	bool pin_workers = false;
+
+	// collect_stats: keep the counters threadpool::stats() reports.  Costs two clock reads and a few
+	// uncontended atomic adds per task, so it can stay on in production; off, it costs a branch.
+	bool collect_stats = false;
+
+	// Elastic pools: with max_threads above threads, the pool starts `threads` workers and adds more,
+	// up to max_threads, while tasks wait longer than grow_latency seconds to start.  Workers beyond
+	// the first `threads` exit after idle_timeout seconds without work.  0 keeps the size fixed.
+	// There's no monitor thread: the check runs when a worker starts a task and when a task is submitted
+	// while every worker is busy, so a pool whose workers are all blocked grows on the next submit.
+	int max_threads = 0;
+	double grow_latency = 0.002;
+	double idle_timeout = 1.0;
+
+	// The clock timers are scheduled on, in seconds.  Null means steady_seconds();
+	// set it to GetTimeSampleSeconds to pass TimeSamples from Timing.h straight to add_task_at.
+	double (*clock)() = nullptr;
+
+	// Bound on queued tasks, 0 for none.  It's checked before queueing, so producers racing each other
+	// can overshoot it by one each; add_tasks, timers, coroutine resumptions and the tasks jd/thread
+	// queues for itself (add_task_unbounded) count toward it but are always let in.  A cancelled task (see task_options) keeps its slot until a worker
+	// reaches it and drops it, so a burst of cancelled work can still fill the pool for a while.
+	size_t capacity = 0;
+	overflow_policy overflow = overflow_policy::block;
+};
+
+// identifies a timer from add_task_at / add_task_after / add_periodic, for cancel_timer
+typedef uint64_t timer_id;
+
+// Per-task controls for add_task(const task_options &, f).
+// A task whose token is cancelled, or whose deadline (on the pool's timer clock, see threadpool::now())
+// has passed, by the time a worker takes it is dropped without running, and its future throws task_cancelled.
+// Until then it stays queued, and counts toward threadpool_options::capacity.
+// Once it's running it can poll this_task::cancelled().
+struct task_options {
+	task_priority priority = task_priority::normal;
+	cancel_token token;
+	double deadline = std::numeric_limits<double>::infinity();
+};
+
+namespace detail {
+
+// the callable a future-returning add_task queues: runs fn and fulfills the promise
+template<typename Fn, typename Rt>
+struct promise_call {
+	Fn fn;
+	std::promise<Rt> promise;
+
+	void operator()() {
+		try {
+			promise.set_value(fn());
+		} catch(...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+};
+
+template<typename Fn>
+struct promise_call<Fn, void> {
+	Fn fn;
+	std::promise<void> promise;
+
+	void operator()() {
+		try {
+			fn();
+			promise.set_value();
+		} catch(...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+};
+
+// The context is built when the task runs rather than stored, so that with a pointer-sized callable
+// this is 64 bytes and still fits in a task inline.
+template<typename Fn, typename Rt>
+struct cancellable_call {
+	promise_call<Fn, Rt> call;
+	cancel_token token;
+	double deadline;
+	double (*clock)();
+
+	void operator()() {
+		const task_context ctx(token, deadline, clock);
+		if(ctx.cancelled()) {
+			call.promise.set_exception(std::make_exception_ptr(task_cancelled()));
+			return;
+		}
+		task_context_scope scope(ctx);
+		call();
+	}
+};
+
+} // namespace detail
+
 class threadpool {
-	std::vector<std::thread> pool;
-	bool stop;
+	struct worker {
+		std::thread thread;
+		work_deque<task> local;
+		unsigned seed;
+		int cpu;                            // pinned cpu, or -1
+		bool running;                       // has a live thread; changed under access
+		std::vector<int> near;              // other workers sharing a cache, closest first (pinned pools only)
+		detail::live_worker_stats stats;
+		int skipped[task_priority_count];   // consecutive pops that passed over waiting work in each lane
+	};
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<bool> stop;
+	const schedule_policy policy;
+	const int idle_spin;
+	const int idle_yield;
+	const int reserved;             // workers [0,reserved) only run critical tasks
+	const int starvation_limit;
 
 	std::mutex access;
 	std::condition_variable cond;
-	std::deque<std::function<void()>> tasks;
+	std::condition_variable reserved_cond;
+	std::condition_variable room;       // producers blocked on a full bounded pool
+	ring_buffer<task> lanes[task_priority_count];
+	std::atomic<size_t> lane_count[task_priority_count];   // lanes[i].size(), readable without the lock
+	std::unique_ptr<mpmc_queue<task>> lock_free_tasks;     // normal lane, null unless queue_impl::lock_free
+	std::atomic<int> sleepers;          // workers parked on cond
+	std::atomic<int> reserved_sleepers; // reserved workers parked on reserved_cond
+
+	std::shared_ptr<block_cache> future_cache;  // shared state for the futures add_task hands out
+
+	const bool collect_stats;
+	detail::live_worker_stats outside_stats;    // run_one callers and producers that aren't our workers
+
+	// elastic pools: workers [0,min_workers) live as long as the pool, the other slots come and go
+	const int min_workers;
+	const int64_t grow_latency_ns;
+	const int64_t idle_timeout_ns;
+	std::atomic<int> live;                      // workers with a running thread
+	std::atomic<int> busy;                      // workers inside a task (elastic pools only)
+	std::atomic<int64_t> last_start;            // stat_now() when a worker last started a task
+	std::atomic<int64_t> last_grow;
+
+	// Timers live in a heap that workers poll before looking for work, and parked workers
+	// wait with a timeout on the earliest one, so no thread is dedicated to them.
+	struct timer_entry {
+		task fn;                                // one-shot timers
+		std::shared_ptr<task> periodic;         // periodic timers; invoked again each interval
+		double interval = 0;
+		task_priority pri = task_priority::normal;
+	};
+	double (*const clock)();
+	std::mutex timer_access;
+	timer_heap<timer_entry> timers;
+	std::atomic<double> next_timer;             // timers.next_due(), readable without the lock
+
+	// bounded pools
+	const size_t capacity;
+	const overflow_policy overflow;
+	std::atomic<size_t> queued;                 // tasks pushed and not yet taken, kept only with a capacity
+	std::atomic<int> blocked_producers;
+	std::atomic<uint64_t> overflow_counts[3];   // by overflow_policy: blocked, rejected, ran inline
+	std::atomic<int64_t> blocked_ns;
+
+	std::atomic<uint64_t> pin_failures;
 
 public:
-	explicit threadpool(int nr = 1) : stop(false) {
-		while(nr-->0) {
-			add_worker();
+	explicit threadpool(int nr = 1) : threadpool(threadpool_options_for(nr)) {
+	}
+	explicit threadpool(const threadpool_options & opt)
+		: stop(false), policy(opt.policy), idle_spin(opt.idle_spin), idle_yield(opt.idle_yield),
+		  reserved(reserved_count(opt)),
+		  starvation_limit(opt.starvation_limit), sleepers(0), reserved_sleepers(0),
+		  future_cache(std::make_shared<block_cache>()), collect_stats(opt.collect_stats),
+		  min_workers(thread_count(opt)),
+		  grow_latency_ns((int64_t)(opt.grow_latency * 1e9)), idle_timeout_ns((int64_t)(opt.idle_timeout * 1e9)),
+		  live(0), busy(0), last_start(stat_now()), last_grow(0),
+		  clock(opt.clock ? opt.clock : &steady_seconds), next_timer(std::numeric_limits<double>::infinity()),
+		  capacity(opt.capacity), overflow(opt.overflow), queued(0), blocked_producers(0), blocked_ns(0),
+		  pin_failures(0) {
+		for(auto & c : overflow_counts) {
+			c.store(0, std::memory_order_relaxed);
+		}
+		for(int i = 0; i < task_priority_count; i++) {
+			lane_count[i].store(0, std::memory_order_relaxed);
 		}
+		if(opt.queue == queue_impl::lock_free) {
+			lock_free_tasks.reset(new mpmc_queue<task>(opt.lock_free_capacity));
+		}
+		start(min_workers, (opt.max_threads > min_workers) ? opt.max_threads : min_workers, opt.pin_workers);
 	}
 	~threadpool() {
-		stop = true;
-		for(std::thread &t : pool) {
-			t.join();
+		{
+			// set under the lock, so a worker can't check stop and then park after the notify
+			std::unique_lock<std::mutex> lock(access);
+			stop = true;
+		}
+		cond.notify_all();
+		reserved_cond.notify_all();
+		room.notify_all();
+		for(auto & w : workers) {
+			if(w->thread.joinable()) {
+				w->thread.join();
+			}
+		}
+		workers.clear();
+	}
+
+	threadpool(const threadpool&) = delete;
+	threadpool& operator=(const threadpool&) = delete;
+
+	// workers running now; for an elastic pool this moves between threads and max_size()
+	int size() const { return live.load(std::memory_order_relaxed); }
+	int max_size() const { return (int)workers.size(); }
+	bool is_elastic() const { return max_size() > min_workers; }
+	schedule_policy get_policy() const { return policy; }
+	queue_impl get_queue_impl() const { return lock_free_tasks ? queue_impl::lock_free : queue_impl::locked; }
+
+	// index of the calling worker in this pool, or -1 if called from some other thread
+	int current_worker() const {
+		const worker_slot & s = this_worker_slot();
+		return (s.pool == this) ? s.index : -1;
+	}
+
+	// Run one queued task on the calling thread, if there is one.
+	// Lets a thread that is waiting on pool work help with it instead of blocking.
+	bool run_one() {
+		const int index = current_worker();
+		task t;
+		if(!find_task(index, t)) {
+			return false;
+		}
+		run(index, t);
+		return true;
+	}
+
+	// tasks waiting right now, in any lane or deque (approximate while the pool is busy)
+	size_t queue_depth() const {
+		size_t n = 0;
+		for(int i = 0; i < task_priority_count; i++) {
+			n += lane_count[i].load(std::memory_order_relaxed);
+		}
+		if(lock_free_tasks) {
+			n += lock_free_tasks->size();
+		}
+		for(auto & w : workers) {
+			n += w->local.size();
 		}
-		pool.clear();
+		return n;
+	}
+
+	// now on the timer clock
+	double now() const { return clock(); }
+
+	// Queue fn when the timer clock reaches `when` (a TimeSample, if clock is GetTimeSampleSeconds).
+	// A timer fires when a worker next looks for work after it's due; the task then waits its turn
+	// in its priority lane like any other.
+	template<class F>
+	timer_id add_task_at(double when, F && fn, task_priority pri = task_priority::normal) {
+		timer_entry e;
+		e.fn = task(std::forward<F>(fn));
+		e.pri = pri;
+		return add_timer(when, std::move(e));
+	}
+
+	template<class F>
+	timer_id add_task_after(double seconds, F && fn, task_priority pri = task_priority::normal) {
+		return add_task_at(now() + seconds, std::forward<F>(fn), pri);
+	}
+
+	// Run fn every `interval` seconds, starting one interval from now, until cancel_timer.
+	// The next run is scheduled when one finishes, so runs never overlap; a run that overruns
+	// its interval is followed right away, without trying to catch up on the ones it missed.
+	// A run that throws stops the timer, as cancel_timer would; the exception goes no further.
+	template<class F>
+	timer_id add_periodic(double interval, F && fn, task_priority pri = task_priority::normal) {
+		timer_entry e;
+		e.periodic = std::make_shared<task>(std::forward<F>(fn));
+		e.interval = interval;
+		e.pri = pri;
+		return add_timer(now() + interval, std::move(e));
+	}
+
+	// Stop a timer.  True if it hadn't fired yet (or, for a periodic timer, if it was still scheduled).
+	// A run already queued or running still finishes.
+	bool cancel_timer(timer_id t) {
+		std::lock_guard<std::mutex> lock(timer_access);
+		bool ok = timers.cancel(t);
+		next_timer.store(timers.next_due(), std::memory_order_relaxed);
+		return ok;
+	}
+
+	size_t pending_timers() {
+		std::lock_guard<std::mutex> lock(timer_access);
+		return timers.size();
+	}
+
+	// Snapshot of the counters; all zero unless threadpool_options::collect_stats is set.
+	threadpool_stats stats() const {
+		threadpool_stats s;
+		s.taken_at = stat_now();
+		s.queue_depth = queue_depth();
+		for(auto & w : workers) {
+			s.workers.push_back(w->stats.read());
+		}
+		s.outside = outside_stats.read();
+		s.blocked = overflow_counts[(int)overflow_policy::block].load(std::memory_order_relaxed);
+		s.rejected = overflow_counts[(int)overflow_policy::reject].load(std::memory_order_relaxed);
+		s.ran_inline = overflow_counts[(int)overflow_policy::run_inline].load(std::memory_order_relaxed);
+		s.blocked_ns = blocked_ns.load(std::memory_order_relaxed);
+		s.pin_failures = pin_failures.load(std::memory_order_relaxed);
+		return s;
+	}
+
+	// Run queued tasks on the calling thread until done() returns true.
+	// This is how anything in jd/thread waits on pool work: a waiting worker keeps working,
+	// so nested fork-join can't deadlock, even on a one-thread pool.
+	template<class Pred>
+	void help_until(Pred done) {
+		for(int spins = 0; !done(); ) {
+			if(run_one()) {
+				spins = 0;
+			} else if(spins++ < 64) {
+				cpu_relax();
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// Queue f(), and return a future for its result (or the exception it threw).
+	// The pool owns the callable, so f can be a temporary or move-only.  A callable of up to
+	// task::inline_size bytes is stored in the queue entry itself, and the future's shared state comes
+	// from the pool's block_cache, so once the pool is warmed up submitting a small lambda doesn't allocate.
+	template<class F>
+	auto add_task(F && f) -> std::future<decltype(std::declval<typename std::decay<F>::type&>()())> {
+		return add_task(task_priority::normal, std::forward<F>(f));
+	}
+
+	template<class F>
+	auto add_task(task_priority pri, F && f) -> std::future<decltype(std::declval<typename std::decay<F>::type&>()())> {
+		typedef typename std::decay<F>::type Fn;
+		typedef decltype(std::declval<Fn&>()()) Rt;
+
+		std::promise<Rt> promise(std::allocator_arg, cache_allocator<Rt>(future_cache));
+		std::future<Rt> ret = promise.get_future();
+		submit(task(detail::promise_call<Fn, Rt>{ std::forward<F>(f), std::move(promise) }), pri);
+		return ret;
+	}
+
+	// Queue f() with a priority, a cancel token and a deadline; see task_options.
+	// Dropped tasks still reach the front of their lane, but all that's left of them is a check.
+	// Like add_task(f) it doesn't allocate once the pool is warm, as long as f is no bigger than a pointer
+	// (a lambda capturing one reference, say); bigger callables push the task to the heap.
+	template<class F>
+	auto add_task(const task_options & o, F && f) -> std::future<decltype(std::declval<typename std::decay<F>::type&>()())> {
+		typedef typename std::decay<F>::type Fn;
+		typedef decltype(std::declval<Fn&>()()) Rt;
+
+		std::promise<Rt> promise(std::allocator_arg, cache_allocator<Rt>(future_cache));
+		std::future<Rt> ret = promise.get_future();
+		submit(task(detail::cancellable_call<Fn, Rt>{ { std::forward<F>(f), std::move(promise) }, o.token, o.deadline, clock }), o.priority);
+		return ret;
+	}
+
+	// Queue a batch, with no futures: jd::tasks, or callables that convert to one, moved from the range
+	// (a forward range: a bounded pool counts it before queueing it).
+	// The batch goes in under one lock (the lock_free queue and worker-local deques take it in runs of
+	// bulk_chunk, one CAS or lock per run), and only as many parked workers are woken as it has tasks.
+	template<class It>
+	void add_tasks(It first, It last, task_priority pri = task_priority::normal) {
+		push_bulk(first, last, pri);
+	}
+
+	template<class Range>
+	void add_tasks(Range && r, task_priority pri = task_priority::normal) {
+		using std::begin;
+		using std::end;
+		push_bulk(begin(r), end(r), pri);
+	}
+
+	// Queue a prebuilt task, with no future.  Doesn't allocate if t's callable is stored inline.
+	void add_task(task && t) {
+		submit(std::move(t), task_priority::normal);
+	}
+
+	void add_task(task_priority pri, task && t) {
+		submit(std::move(t), pri);
+	}
+
+	// Queue t whatever the overflow policy: it counts toward capacity, but is always let in.
+	// For tasks queued on behalf of work the pool already took -- parallel_for's helpers, a task_graph's
+	// ready nodes, a pipeline's next stage -- since turning those away would strand whoever waits on them.
+	void add_task_unbounded(task && t, task_priority pri = task_priority::normal) {
+		push(std::move(t), pri);
 	}
 
 	template<class Rt>
 	void add_task(std::function<Rt()> & f) {
-		std::unique_lock<std::mutex> lock(access);
-		tasks.push_back([=]{
-            f();
-        });
-		cond.notify_one();
+		submit(task(f), task_priority::normal);
 	}
 
-	template<class Rt>
-	auto add_task(std::packaged_task<Rt()>& pt) -> std::future<Rt> {
-		std::unique_lock<std::mutex> lock(access);
+	// add_task, except that on a full bounded pool it returns an invalid future (!valid())
+	// instead of following the overflow policy
+	template<class F>
+	auto try_add_task(F && f, task_priority pri = task_priority::normal)
+		-> std::future<decltype(std::declval<typename std::decay<F>::type&>()())> {
+		typedef decltype(std::declval<typename std::decay<F>::type&>()()) Rt;
+		if(full()) {
+			overflow_counts[(int)overflow_policy::reject].fetch_add(1, std::memory_order_relaxed);
+			return std::future<Rt>();
+		}
+		return add_task(pri, std::forward<F>(f));
+	}
 
-		auto ret = pt.get_future();
-		tasks.push_back([&pt]{pt();});
+	bool try_add_task(task && t, task_priority pri = task_priority::normal) {
+		if(full()) {
+			overflow_counts[(int)overflow_policy::reject].fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		push(std::move(t), pri);
+		return true;
+	}
 
-		cond.notify_one();
+#if JD_THREAD_COROUTINES
+	// co_await pool.schedule() suspends the calling coroutine and resumes it on one of the pool's workers.
+	struct schedule_awaiter {
+		threadpool & pool;
+		task_priority pri;
 
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { pool.push(task([h]{ h.resume(); }), pri); }
+		void await_resume() const noexcept {}
+	};
+
+	schedule_awaiter schedule(task_priority pri = task_priority::normal) {
+		return schedule_awaiter{ *this, pri };
+	}
+#endif
+
+	// NOTE: the pool only keeps a reference to pt, so pt has to outlive the task.
+	template<class Rt>
+	auto add_task(std::packaged_task<Rt()>& pt) -> std::future<Rt> {
+		auto ret = pt.get_future();
+		submit(task([&pt]{pt();}), task_priority::normal);
 		return ret;
 	}
 
 private:
-	void add_worker() {
-		std::thread t([this]() {
+	struct worker_slot {
+		const threadpool * pool;
+		int index;
+	};
+	static threadpool_options threadpool_options_for(int nr) {
+		threadpool_options opt;
+		opt.threads = nr;
+		return opt;
+	}
+
+	static int thread_count(const threadpool_options & opt) {
+		return opt.use_physical_cores ? get_cpu_topology().cores : opt.threads;
+	}
+	static int reserved_count(const threadpool_options & opt) {
+		const int n = thread_count(opt);
+		return opt.reserved_critical_workers < n ? opt.reserved_critical_workers : (n > 0 ? n - 1 : 0);
+	}
+
+	detail::live_worker_stats & stats_for(int index) {
+		return (index >= 0) ? workers[index]->stats : outside_stats;
+	}
+
+	void run(int index, task & t) {
+		if(capacity) {
+			release_slot();
+		}
+		scratch_scope scratch;   // whatever the task takes from this_worker::scratch() goes back when it returns
+		if(!collect_stats) {
+			t();
+			return;
+		}
+		detail::live_worker_stats & st = stats_for(index);
+		const int64_t start = stat_now();
+		st.queued.add((uint64_t)(start - t.queued_at));
+		if(st.tasks.load(std::memory_order_relaxed) % threadpool_stats::depth_sample_rate == 0) {
+			st.depth.add(queue_depth());
+		}
+		t();
+		st.running.add((uint64_t)(stat_now() - start));
+		st.tasks.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Lock access, timing the wait if the lock is contended.
+	std::unique_lock<std::mutex> lock_access() {
+		if(!collect_stats) {
+			return std::unique_lock<std::mutex>(access);
+		}
+		std::unique_lock<std::mutex> lock(access, std::try_to_lock);
+		if(!lock.owns_lock()) {
+			const int64_t start = stat_now();
+			lock.lock();
+			stats_for(current_worker()).lock_wait.add((uint64_t)(stat_now() - start));
+		}
+		return lock;
+	}
+
+	timer_id add_timer(double when, timer_entry && e) {
+		timer_id t;
+		bool earliest;
+		{
+			std::lock_guard<std::mutex> lock(timer_access);
+			t = timers.insert(when, std::move(e));
+			earliest = when < next_timer.load(std::memory_order_relaxed);
+			next_timer.store(timers.next_due(), std::memory_order_relaxed);
+		}
+		if(earliest) {
+			// parked workers are waiting on the old earliest timer
+			wake_one();
+		}
+		return t;
+	}
+
+	bool timer_due() const {
+		const double due = next_timer.load(std::memory_order_relaxed);
+		return due != std::numeric_limits<double>::infinity() && due <= clock();
+	}
+
+	// queue every timer that's due
+	void poll_timers() {
+		if(!timer_due()) {
+			return;
+		}
+		const double now = clock();
+		for(;;) {
+			task fire;
+			task_priority pri;
+			{
+				std::lock_guard<std::mutex> lock(timer_access);
+				timer_id t;
+				double due;
+				timer_entry * e;
+				if(!timers.pop_due(now, t, due, e)) {
+					next_timer.store(timers.next_due(), std::memory_order_relaxed);
+					return;
+				}
+				pri = e->pri;
+				if(e->periodic) {
+					std::shared_ptr<task> fn = e->periodic;
+					const double interval = e->interval;
+					fire = task([this, t, fn, interval, due]{
+						try {
+							(*fn)();
+						} catch(...) {
+							cancel_timer(t);
+							return;
+						}
+						rearm_timer(t, std::max(due + interval, clock()));
+					});
+				} else {
+					fire = std::move(e->fn);
+					timers.erase(t);
+				}
+				next_timer.store(timers.next_due(), std::memory_order_relaxed);
+			}
+			push(std::move(fire), pri);
+		}
+	}
+
+	void rearm_timer(timer_id t, double when) {
+		bool earliest;
+		{
+			std::lock_guard<std::mutex> lock(timer_access);
+			if(!timers.rearm(t, when)) {
+				return;
+			}
+			earliest = when < next_timer.load(std::memory_order_relaxed);
+			next_timer.store(timers.next_due(), std::memory_order_relaxed);
+		}
+		if(earliest) {
+			wake_one();
+		}
+	}
+
+	// when a parked worker should wake up for the earliest timer, on the condition variable's clock
+	std::chrono::steady_clock::time_point timer_wake_time() const {
+		const double due = next_timer.load(std::memory_order_relaxed);
+		if(due == std::numeric_limits<double>::infinity()) {
+			return std::chrono::steady_clock::time_point::max();
+		}
+		const double wait = due - clock();
+		return std::chrono::steady_clock::now()
+			+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(wait > 0 ? wait : 0));
+	}
+
+	static worker_slot & this_worker_slot() {
+		static thread_local worker_slot slot = { nullptr, -1 };
+		return slot;
+	}
+
+	// steal() seed for threads that aren't workers of this pool
+	static unsigned & outside_seed() {
+		static thread_local unsigned seed = 0x2545f491u;
+		return seed;
+	}
+
+	void start(int nr, int slots, bool pin) {
+		std::vector<int> cpus;
+		if(pin) {
+			cpus = get_cpu_topology().spread_order();
+		}
+		// every worker slot must exist before any worker starts looking for victims,
+		// so the vector never changes while threads are reading it
+		for(int i = 0; i < slots; i++) {
+			std::unique_ptr<worker> w(new worker);
+			w->running = (i < nr);
+			w->seed = 0x9e3779b9u * (unsigned)(i + 1);
+			w->cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+			for(int l = 0; l < task_priority_count; l++) {
+				w->skipped[l] = 0;
+			}
+			workers.push_back(std::move(w));
+		}
+		if(!cpus.empty()) {
+			find_neighbors();
+		}
+		live.store(nr, std::memory_order_relaxed);
+		for(int i = 0; i < nr; i++) {
+			add_worker(i);
+		}
+	}
+
+	// start a worker in a free elastic slot, at most once per grow_latency
+	void grow(int64_t now) {
+		if(now - last_grow.load(std::memory_order_relaxed) < grow_latency_ns) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock = lock_access();
+		if(stop || now - last_grow.load(std::memory_order_relaxed) < grow_latency_ns) {
+			return;
+		}
+		for(int i = min_workers; i < (int)workers.size(); i++) {
+			worker & w = *workers[i];
+			if(!w.running) {
+				// a retired thread drops running as its last act, so this join is short
+				if(w.thread.joinable()) {
+					w.thread.join();
+				}
+				w.running = true;
+				live.fetch_add(1, std::memory_order_relaxed);
+				last_grow.store(now, std::memory_order_relaxed);
+				add_worker(i);
+				return;
+			}
+		}
+	}
+
+	// the task a worker just took waited past grow_latency, and there's more behind it
+	void note_start(const task & t) {
+		const int64_t now = stat_now();
+		last_start.store(now, std::memory_order_relaxed);
+		if(now - t.queued_at > grow_latency_ns && live.load(std::memory_order_relaxed) < (int)workers.size()
+			&& queue_depth() > 0) {
+			grow(now);
+		}
+	}
+
+	// the enqueue time for stats and elastic growth (0 when neither is on), checking for growth on the way
+	int64_t push_stamp() {
+		if(!collect_stats && !is_elastic()) {
+			return 0;
+		}
+		const int64_t now = stat_now();
+		if(is_elastic() && busy.load(std::memory_order_relaxed) >= live.load(std::memory_order_relaxed)
+			&& now - last_start.load(std::memory_order_relaxed) > grow_latency_ns) {
+			// nobody idle, and no task has started for a while: everyone is stuck on something long
+			grow(now);
+		}
+		return now;
+	}
+
+	bool full() const {
+		return capacity && queued.load(std::memory_order_seq_cst) >= capacity;
+	}
+
+	// add_task's way in: push, unless the pool is full and the overflow policy says otherwise
+	void submit(task && t, task_priority pri) {
+		if(full()) {
+			overflow_policy how = overflow;
+			if(how == overflow_policy::block && current_worker() >= 0) {
+				how = overflow_policy::run_inline;
+			}
+			overflow_counts[(int)how].fetch_add(1, std::memory_order_relaxed);
+			if(how == overflow_policy::reject) {
+				throw queue_full();
+			}
+			if(how == overflow_policy::run_inline) {
+				scratch_scope scratch;
+				t();
+				return;
+			}
+			wait_for_room();
+		}
+		push(std::move(t), pri);
+	}
+
+	// Blocked producers and workers taking tasks pair up like park() and wake_one(): each side
+	// writes its own counter, then reads the other's, all seq_cst, so at least one of them sees the other.
+	void wait_for_room() {
+		const int64_t start = stat_now();
+		{
+			std::unique_lock<std::mutex> lock = lock_access();
+			blocked_producers.fetch_add(1, std::memory_order_seq_cst);
+			while(!stop && full()) {
+				room.wait(lock);
+			}
+			blocked_producers.fetch_sub(1, std::memory_order_relaxed);
+		}
+		blocked_ns.fetch_add(stat_now() - start, std::memory_order_relaxed);
+	}
+
+	void release_slot() {
+		queued.fetch_sub(1, std::memory_order_seq_cst);
+		if(blocked_producers.load(std::memory_order_seq_cst) > 0) {
+			std::unique_lock<std::mutex> lock = lock_access();
+			room.notify_one();
+		}
+	}
+
+	void push(task && t, task_priority pri) {
+		if(capacity) {
+			queued.fetch_add(1, std::memory_order_relaxed);
+		}
+		t.queued_at = push_stamp();
+		if(pri == task_priority::normal) {
+			int index = current_worker();
+			if(policy == schedule_policy::work_stealing && index >= reserved) {
+				workers[index]->local.push_back(std::move(t));
+				wake_one();
+				return;
+			}
+			if(lock_free_tasks && lock_free_tasks->try_push(std::move(t))) {
+				wake_one();
+				return;
+			}
+		}
+		std::unique_lock<std::mutex> lock = lock_access();
+		ring_buffer<task> & lane = lanes[(int)pri];
+		lane.push_back(std::move(t));
+		lane_count[(int)pri].store(lane.size(), std::memory_order_relaxed);
+		if(pri == task_priority::critical && reserved_sleepers.load(std::memory_order_relaxed) > 0) {
+			reserved_cond.notify_one();
+		} else if(sleepers.load(std::memory_order_relaxed) > 0) {
+			cond.notify_one();
+		}
+	}
+
+	static const size_t bulk_chunk = 64;
+
+	template<class It>
+	void push_bulk(It first, It last, task_priority pri) {
+		if(capacity) {
+			queued.fetch_add((size_t)std::distance(first, last), std::memory_order_relaxed);
+		}
+		const int64_t stamp = push_stamp();
+		size_t n = 0;
+		if(pri == task_priority::normal) {
+			const int index = current_worker();
+			const bool local = policy == schedule_policy::work_stealing && index >= reserved;
+			if(local || lock_free_tasks) {
+				task buf[bulk_chunk];
+				while(first != last) {
+					size_t k = 0;
+					for(; k < bulk_chunk && first != last; ++k, ++first) {
+						buf[k] = task(std::move(*first));
+						buf[k].queued_at = stamp;
+					}
+					size_t sent = 0;
+					if(local) {
+						workers[index]->local.push_back_batch(buf, k);
+						sent = k;
+					} else {
+						sent = lock_free_tasks->try_push_batch(buf, k);
+					}
+					n += sent;
+					if(sent < k) {
+						// lock_free queue full: the rest of this run spills into the locked lane
+						std::unique_lock<std::mutex> lock = lock_access();
+						ring_buffer<task> & lane = lanes[(int)pri];
+						for(size_t i = sent; i < k; i++) {
+							lane.push_back(std::move(buf[i]));
+						}
+						lane_count[(int)pri].store(lane.size(), std::memory_order_relaxed);
+						n += k - sent;
+					}
+				}
+				wake_some(n);
+				return;
+			}
+		}
+		std::unique_lock<std::mutex> lock = lock_access();
+		ring_buffer<task> & lane = lanes[(int)pri];
+		for(; first != last; ++first, ++n) {
+			task t(std::move(*first));
+			t.queued_at = stamp;
+			lane.push_back(std::move(t));
+		}
+		lane_count[(int)pri].store(lane.size(), std::memory_order_relaxed);
+		if(pri == task_priority::critical && reserved_sleepers.load(std::memory_order_relaxed) > 0) {
+			notify_some(reserved_cond, reserved_sleepers, n);
+		} else {
+			notify_some(cond, sleepers, n);
+		}
+	}
+
+	// with access held: wake up to n of the workers parked on cv
+	static void notify_some(std::condition_variable & cv, const std::atomic<int> & count, size_t n) {
+		const size_t parked = (size_t)count.load(std::memory_order_relaxed);
+		if(n >= parked) {
+			if(parked) {
+				cv.notify_all();
+			}
+			return;
+		}
+		for(size_t i = 0; i < n; i++) {
+			cv.notify_one();
+		}
+	}
+
+	// wake_one for a batch of n
+	void wake_some(size_t n) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(n && sleepers.load(std::memory_order_relaxed) > 0) {
+			std::unique_lock<std::mutex> lock = lock_access();
+			notify_some(cond, sleepers, n);
+		}
+	}
+
+	// for normal pushes that don't go through access: pairs with the fence in park(),
+	// so either we see the sleeper or the sleeper sees our task
+	void wake_one() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleepers.load(std::memory_order_relaxed) > 0) {
+			std::unique_lock<std::mutex> lock = lock_access();
+			cond.notify_one();
+		}
+	}
+
+	bool is_reserved(int index) const { return index >= 0 && index < reserved; }
+
+	// normal work waiting outside the worker-local deques
+	bool normal_waiting() const {
+		return lane_count[(int)task_priority::normal].load(std::memory_order_relaxed) > 0
+			|| (lock_free_tasks && !lock_free_tasks->empty());
+	}
+
+	bool has_work(int index) const {
+		if(lane_count[(int)task_priority::critical].load(std::memory_order_relaxed) > 0) {
+			return true;
+		}
+		if(is_reserved(index)) {
+			return false;
+		}
+		if(normal_waiting() || lane_count[(int)task_priority::background].load(std::memory_order_relaxed) > 0) {
+			return true;
+		}
+		if(timer_due()) {
+			return true;
+		}
+		if(policy == schedule_policy::work_stealing) {
+			for(auto & w : workers) {
+				if(!w->local.empty()) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// spin, then yield, then park until there is work or the pool is stopping.
+	// Returns true if this worker should exit: an elastic worker that parked for idle_timeout.
+	bool idle(int index) {
+		for(int i = 0; i < idle_spin; i++) {
+			if(stop || has_work(index)) {
+				return false;
+			}
+			cpu_relax();
+		}
+		for(int i = 0; i < idle_yield; i++) {
+			if(stop || has_work(index)) {
+				return false;
+			}
+			std::this_thread::yield();
+		}
+		return park(index);
+	}
+
+	bool park(int index) {
+		const bool r = is_reserved(index);
+		std::atomic<int> & count = r ? reserved_sleepers : sleepers;
+		std::condition_variable & cv = r ? reserved_cond : cond;
+		std::unique_lock<std::mutex> lock = lock_access();
+		count.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		typedef std::chrono::steady_clock steady;
+		const bool elastic = index >= min_workers;
+		const steady::time_point retire_at = elastic ? steady::now() + std::chrono::nanoseconds(idle_timeout_ns)
+		                                             : steady::time_point::max();
+		bool retire = false;
+		while(!stop && !has_work(index)) {
+			steady::time_point deadline = retire_at;
+			if(!r) {
+				deadline = std::min(deadline, timer_wake_time());
+			}
+			if(deadline == steady::time_point::max()) {
+				cv.wait(lock);
+			} else if(cv.wait_until(lock, deadline) == std::cv_status::timeout && elastic
+			          && steady::now() >= retire_at && !stop && !has_work(index)) {
+				retire = true;
+				break;
+			}
+		}
+		count.fetch_sub(1, std::memory_order_relaxed);
+		if(retire) {
+			// its local deque is empty (has_work just said so), and only this worker pushes to it
+			workers[index]->running = false;
+			live.fetch_sub(1, std::memory_order_relaxed);
+		}
+		return retire;
+	}
+
+	bool pop_lane(task_priority pri, task & t) {
+		if(lane_count[(int)pri].load(std::memory_order_relaxed) == 0) {
+			return false;
+		}
+		std::unique_lock<std::mutex> lock = lock_access();
+		ring_buffer<task> & lane = lanes[(int)pri];
+		if(!lane.pop_front(t)) {
+			return false;
+		}
+		lane_count[(int)pri].store(lane.size(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// closest first, so stolen work finds its data in a cache the victim already warmed
+	void find_neighbors() {
+		const cpu_topology & topo = get_cpu_topology();
+		for(int i = 0; i < (int)workers.size(); i++) {
+			std::vector<std::pair<int, int>> near;  // (-closeness, worker)
+			for(int j = 0; j < (int)workers.size(); j++) {
+				int c = topo.closeness(workers[i]->cpu, workers[j]->cpu);
+				if(j != i && c > 0) {
+					near.push_back(std::make_pair(-c, j));
+				}
+			}
+			std::sort(near.begin(), near.end());
+			for(auto & v : near) {
+				workers[i]->near.push_back(v.second);
+			}
+		}
+	}
+
+	bool steal(int index, task & t) {
+		const int n = (int)workers.size();
+		if(n < 2) {
+			return false;
+		}
+		if(index >= 0) {
+			for(int victim : workers[index]->near) {
+				if(workers[victim]->local.steal_front(t)) {
+					note_steal(index);
+					return true;
+				}
+			}
+		}
+		// xorshift, so thieves spread out instead of all hitting worker 0
+		unsigned & x = (index >= 0) ? workers[index]->seed : outside_seed();
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		const int first = (int)(x % (unsigned)n);
+		for(int i = 0; i < n; i++) {
+			int victim = (first + i) % n;
+			if(victim != index && workers[victim]->local.steal_front(t)) {
+				note_steal(index);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void note_steal(int index) {
+		if(collect_stats) {
+			stats_for(index).steals.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	bool pop_normal(int index, task & t) {
+		if(policy == schedule_policy::work_stealing) {
+			return (index >= 0 && workers[index]->local.pop_back(t))
+				|| (lock_free_tasks && lock_free_tasks->try_pop(t))
+				|| pop_lane(task_priority::normal, t)
+				|| steal(index, t);
+		}
+		return (lock_free_tasks && lock_free_tasks->try_pop(t)) || pop_lane(task_priority::normal, t);
+	}
+
+	// after taking work from lane `taken`, count how often each lower lane with work waiting got passed over
+	void note_skips(worker & w, task_priority taken) {
+		w.skipped[(int)taken] = 0;
+		if(taken == task_priority::critical) {
+			w.skipped[(int)task_priority::normal] = normal_waiting() ? w.skipped[(int)task_priority::normal] + 1 : 0;
+		}
+		if(taken != task_priority::background) {
+			const bool waiting = lane_count[(int)task_priority::background].load(std::memory_order_relaxed) > 0;
+			w.skipped[(int)task_priority::background] = waiting ? w.skipped[(int)task_priority::background] + 1 : 0;
+		}
+	}
+
+	// index is -1 when the caller isn't one of our workers
+	bool find_task(int index, task & t) {
+		if(is_reserved(index)) {
+			return pop_lane(task_priority::critical, t);
+		}
+		poll_timers();
+		if(index < 0) {
+			return pop_lane(task_priority::critical, t) || pop_normal(index, t) || pop_lane(task_priority::background, t);
+		}
+
+		worker & w = *workers[index];
+		if(w.skipped[(int)task_priority::background] >= starvation_limit && pop_lane(task_priority::background, t)) {
+			w.skipped[(int)task_priority::background] = 0;
+			return true;
+		}
+		if(w.skipped[(int)task_priority::normal] >= starvation_limit && pop_normal(index, t)) {
+			note_skips(w, task_priority::normal);
+			return true;
+		}
+		if(pop_lane(task_priority::critical, t)) {
+			note_skips(w, task_priority::critical);
+			return true;
+		}
+		if(pop_normal(index, t)) {
+			note_skips(w, task_priority::normal);
+			return true;
+		}
+		if(pop_lane(task_priority::background, t)) {
+			note_skips(w, task_priority::background);
+			return true;
+		}
+		return false;
+	}
+
+	void add_worker(int index) {
+		workers[index]->thread = std::thread([this, index]() {
+			worker_slot & slot = this_worker_slot();
+			slot.pool = this;
+			slot.index = index;
+			if(workers[index]->cpu >= 0 && !pin_current_thread(workers[index]->cpu)) {
+				pin_failures.fetch_add(1, std::memory_order_relaxed);
+			}
 			while(!stop) {
-				std::function<void()> task;
-				{
-					std::unique_lock<std::mutex> lock(access);
-					if(tasks.empty()) {
-						cond.wait_for(lock, std::chrono::duration<int, std::milli>(5));
-						continue;
+				task t;
+				if(!find_task(index, t)) {
+					const int64_t start = collect_stats ? stat_now() : 0;
+					const bool retire = idle(index);
+					if(collect_stats) {
+						workers[index]->stats.idle_ns.fetch_add(stat_now() - start, std::memory_order_relaxed);
 					}
-					task = std::move(tasks.front());
-					tasks.pop_front();
+					if(retire) {
+						return;
+					}
+					continue;
+				}
+				if(is_elastic()) {
+					note_start(t);
+					busy.fetch_add(1, std::memory_order_relaxed);
+					run(index, t);
+					busy.fetch_sub(1, std::memory_order_relaxed);
+					continue;
 				}
-				task();
+				run(index, t);
 			}
 		});
-		pool.push_back(std::move(t));
 	}
 };
 
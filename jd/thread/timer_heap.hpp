@@ -0,0 +1,173 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+namespace jd {
+
+// the default clock for threadpool timers: seconds on the monotonic clock, as a TimeSample-style double
+inline double steady_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// timer_heap -- an unsynchronized binary min-heap of timers, each holding a T.
+// Values live in a slot array that's recycled through a free list, and the heap only holds
+// (when, slot, generation) triples, so:
+//   insert is O(log n) and doesn't allocate once the arrays have grown,
+//   cancel is O(1): it bumps the slot's generation, and the heap entry goes stale.
+// Stale entries are skipped when they reach the top, and the heap is rebuilt without them
+// once they outnumber the live ones.
+//
+// A timer that pops stays allocated ("fired") until the caller erase()s it or rearm()s it,
+// which is how a periodic timer keeps its id between firings.
+template<typename T>
+class timer_heap {
+public:
+	typedef uint64_t id;    // slot in the low 32 bits, generation in the high; 0 is never a valid id
+
+	timer_heap() : live(0), stale(0), free_head(none) {}
+
+	size_t size() const { return live; }
+	bool empty() const { return live == 0; }
+
+	// when the earliest armed timer is due, or +infinity
+	double next_due() const {
+		return heap.empty() ? std::numeric_limits<double>::infinity() : heap.front().when;
+	}
+
+	id insert(double when, T && value) {
+		uint32_t s;
+		if(free_head != none) {
+			s = free_head;
+			free_head = slots[s].next_free;
+		} else {
+			s = (uint32_t)slots.size();
+			slots.push_back(slot());
+		}
+		slot & sl = slots[s];
+		sl.value = std::move(value);
+		sl.state = armed;
+		++live;
+		push_entry(when, s, sl.gen);
+		return make_id(s, sl.gen);
+	}
+
+	// drop a pending or fired timer; false if t already finished or was cancelled
+	bool cancel(id t) {
+		uint32_t s;
+		if(!valid(t, s)) {
+			return false;
+		}
+		if(slots[s].state == armed) {
+			++stale;
+		}
+		release(s);
+		skip_stale();
+		return true;
+	}
+	bool erase(id t) { return cancel(t); }
+
+	// If the earliest timer is due at `now`, mark it fired and return its id, due time and value.
+	// The value stays in place until erase(t) or rearm(t, ...).
+	bool pop_due(double now, id & t, double & when, T *& value) {
+		if(heap.empty() || heap.front().when > now) {
+			return false;
+		}
+		entry e = heap.front();
+		pop_entry();
+		slots[e.slot].state = fired;
+		skip_stale();
+		t = make_id(e.slot, e.gen);
+		when = e.when;
+		value = &slots[e.slot].value;
+		return true;
+	}
+
+	// put a fired timer back in the heap; false if it was cancelled since it fired
+	bool rearm(id t, double when) {
+		uint32_t s;
+		if(!valid(t, s) || slots[s].state != fired) {
+			return false;
+		}
+		slots[s].state = armed;
+		push_entry(when, s, slots[s].gen);
+		return true;
+	}
+
+private:
+	enum state_t : uint8_t { unused, armed, fired };
+	static const uint32_t none = 0xffffffffu;
+
+	struct slot {
+		T value;
+		uint32_t gen = 1;
+		uint32_t next_free = none;
+		state_t state = unused;
+	};
+	struct entry {
+		double when;
+		uint32_t slot;
+		uint32_t gen;
+	};
+
+	std::vector<slot> slots;
+	std::vector<entry> heap;
+	size_t live;
+	size_t stale;       // heap entries whose timer was cancelled
+	uint32_t free_head;
+
+	static id make_id(uint32_t s, uint32_t gen) { return ((id)gen << 32) | s; }
+
+	bool valid(id t, uint32_t & s) const {
+		s = (uint32_t)t;
+		return s < slots.size() && slots[s].gen == (uint32_t)(t >> 32) && slots[s].state != unused;
+	}
+
+	bool is_stale(const entry & e) const {
+		return slots[e.slot].gen != e.gen || slots[e.slot].state != armed;
+	}
+
+	void release(uint32_t s) {
+		slot & sl = slots[s];
+		sl.value = T();
+		sl.state = unused;
+		if(++sl.gen == 0) {
+			sl.gen = 1;
+		}
+		sl.next_free = free_head;
+		free_head = s;
+		--live;
+	}
+
+	static bool later(const entry & a, const entry & b) { return a.when > b.when; }
+
+	void push_entry(double when, uint32_t s, uint32_t gen) {
+		entry e = { when, s, gen };
+		heap.push_back(e);
+		std::push_heap(heap.begin(), heap.end(), later);
+	}
+
+	void pop_entry() {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		heap.pop_back();
+	}
+
+	// keep the top live, so next_due() is exact, and compact once most entries are dead
+	void skip_stale() {
+		while(!heap.empty() && is_stale(heap.front())) {
+			pop_entry();
+			--stale;
+		}
+		if(stale > 64 && stale > heap.size() / 2) {
+			heap.erase(std::remove_if(heap.begin(), heap.end(), [this](const entry & e) { return is_stale(e); }), heap.end());
+			std::make_heap(heap.begin(), heap.end(), later);
+			stale = 0;
+		}
+	}
+};
+
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <map>
+#include <utility>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace jd {
+
+// cpu_topology -- which logical CPUs are SMT siblings on one core, which cores share a cache,
+// and which package each sits in.  On Linux it's read from /sys/devices/system/cpu;
+// elsewhere (or if sysfs can't be read) every hardware thread is reported as its own core,
+// with no cache sharing known.  get_cpu_topology() only lists the cpus the process may run on,
+// so a pool sized or pinned by it stays inside taskset / cpuset limits.
+struct cpu_topology {
+	struct cpu {
+		int id;         // logical cpu number, as the OS numbers them (what pinning takes)
+		int package;    // physical_package_id
+		int core;       // physical core, numbered 0..cores-1 across all packages
+		int l2;         // lowest cpu id sharing this cpu's L2, or -1 if unknown
+		int llc;        // same for the last-level cache
+	};
+
+	std::vector<cpu> cpus;  // online (and usable) cpus, by id
+	int packages = 0;
+	int cores = 0;
+
+	int logical() const { return (int)cpus.size(); }
+	bool smt() const { return logical() > cores; }
+
+	const cpu * find(int id) const {
+		for(const cpu & c : cpus) {
+			if(c.id == id) {
+				return &c;
+			}
+		}
+		return nullptr;
+	}
+
+	// How close two cpus are, for picking steal victims: 3 same core, 2 shared L2, 1 shared last-level cache,
+	// 0 nothing shared (or not known).
+	int closeness(int a, int b) const {
+		const cpu * x = find(a);
+		const cpu * y = find(b);
+		if(!x || !y) {
+			return 0;
+		}
+		if(x->core == y->core) {
+			return 3;
+		}
+		if(x->l2 >= 0 && x->l2 == y->l2) {
+			return 2;
+		}
+		if(x->llc >= 0 && x->llc == y->llc) {
+			return 1;
+		}
+		return 0;
+	}
+
+	// Cpu ids in the order to place threads on: one per physical core first, alternating between packages,
+	// then the second SMT sibling of every core, and so on.  N threads pinned to the first N entries
+	// get a core each for as long as there are cores.
+	std::vector<int> spread_order() const {
+		std::map<int, int> sibling_rank;    // core -> siblings seen so far
+		std::map<int, int> core_rank;       // package -> cores seen so far
+		std::map<int, int> core_slot;       // core -> its rank inside its package
+		struct key {
+			int sibling, slot, package, id;
+		};
+		std::vector<key> keys;
+		for(const cpu & c : cpus) {
+			if(!core_slot.count(c.core)) {
+				core_slot[c.core] = core_rank[c.package]++;
+			}
+			keys.push_back(key{ sibling_rank[c.core]++, core_slot[c.core], c.package, c.id });
+		}
+		std::sort(keys.begin(), keys.end(), [](const key & a, const key & b) {
+			if(a.sibling != b.sibling) return a.sibling < b.sibling;
+			if(a.slot != b.slot) return a.slot < b.slot;
+			if(a.package != b.package) return a.package < b.package;
+			return a.id < b.id;
+		});
+		std::vector<int> order;
+		for(const key & k : keys) {
+			order.push_back(k.id);
+		}
+		return order;
+	}
+};
+
+namespace detail {
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}, the format of sysfs cpu lists
+inline std::vector<int> parse_cpu_list(const std::string & s) {
+	std::vector<int> ids;
+	std::stringstream in(s);
+	std::string range;
+	while(std::getline(in, range, ',')) {
+		int lo = 0, hi = 0;
+		char dash = 0;
+		std::stringstream r(range);
+		if(!(r >> lo)) {
+			continue;
+		}
+		hi = lo;
+		if(r >> dash >> hi) {
+			if(dash != '-') {
+				hi = lo;
+			}
+		}
+		for(int i = lo; i <= hi; i++) {
+			ids.push_back(i);
+		}
+	}
+	return ids;
+}
+
+inline bool read_sysfs(const std::string & path, std::string & out) {
+	std::ifstream f(path.c_str());
+	if(!f || !std::getline(f, out)) {
+		return false;
+	}
+	return true;
+}
+
+inline bool read_sysfs(const std::string & path, int & out) {
+	std::string s;
+	if(!read_sysfs(path, s)) {
+		return false;
+	}
+	std::stringstream in(s);
+	return (bool)(in >> out);
+}
+
+// the cpus in the calling thread's affinity mask, or none if that can't be read
+inline std::vector<int> affinity_cpus() {
+	std::vector<int> ids;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for(int i = 0; i < CPU_SETSIZE; i++) {
+			if(CPU_ISSET(i, &set)) {
+				ids.push_back(i);
+			}
+		}
+	}
+#endif
+	return ids;
+}
+
+} // namespace detail
+
+// Read the topology under root (normally /sys/devices/system/cpu; tests point it at a fake tree).
+// If usable isn't empty, cpus missing from it are left out as if they were offline.
+inline cpu_topology read_cpu_topology(const std::string & root = "/sys/devices/system/cpu",
+                                      const std::vector<int> & usable = std::vector<int>()) {
+	cpu_topology topo;
+	std::string online;
+	std::vector<int> ids;
+	if(detail::read_sysfs(root + "/online", online)) {
+		ids = detail::parse_cpu_list(online);
+	}
+	if(!usable.empty()) {
+		ids.erase(std::remove_if(ids.begin(), ids.end(), [&](int id) {
+			return std::find(usable.begin(), usable.end(), id) == usable.end();
+		}), ids.end());
+	}
+
+	std::map<std::pair<int, int>, int> core_index;  // (package, core_id) -> core
+	std::map<int, int> package_seen;
+	for(int id : ids) {
+		const std::string dir = root + "/cpu" + std::to_string(id);
+		cpu_topology::cpu c;
+		c.id = id;
+		int package = 0, core_id = id;
+		detail::read_sysfs(dir + "/topology/physical_package_id", package);
+		detail::read_sysfs(dir + "/topology/core_id", core_id);
+		package_seen[package] = 1;
+		std::pair<int, int> k(package, core_id);
+		if(!core_index.count(k)) {
+			int n = (int)core_index.size();
+			core_index[k] = n;
+		}
+		c.package = package;
+		c.core = core_index[k];
+
+		// index0..N, skipping instruction caches; the deepest level seen is the last-level cache
+		c.l2 = -1;
+		c.llc = -1;
+		int llc_level = 0;
+		for(int i = 0; ; i++) {
+			const std::string cache = dir + "/cache/index" + std::to_string(i);
+			int level = 0;
+			if(!detail::read_sysfs(cache + "/level", level)) {
+				break;
+			}
+			std::string type, shared;
+			detail::read_sysfs(cache + "/type", type);
+			if(type == "Instruction" || !detail::read_sysfs(cache + "/shared_cpu_list", shared)) {
+				continue;
+			}
+			std::vector<int> sharing = detail::parse_cpu_list(shared);
+			if(sharing.empty()) {
+				continue;
+			}
+			const int first = *std::min_element(sharing.begin(), sharing.end());
+			if(level == 2) {
+				c.l2 = first;
+			}
+			if(level >= llc_level) {
+				llc_level = level;
+				c.llc = first;
+			}
+		}
+		topo.cpus.push_back(c);
+	}
+
+	if(topo.cpus.empty()) {
+		std::vector<int> any = usable;
+		if(any.empty()) {
+			int n = (int)std::thread::hardware_concurrency();
+			for(int i = 0; i < n || i == 0; i++) {
+				any.push_back(i);
+			}
+		}
+		const int n = (int)any.size();
+		for(int i = 0; i < n; i++) {
+			cpu_topology::cpu c = { any[i], 0, i, -1, -1 };
+			topo.cpus.push_back(c);
+		}
+		topo.packages = 1;
+		topo.cores = n;
+		return topo;
+	}
+	topo.packages = (int)package_seen.size();
+	topo.cores = (int)core_index.size();
+	return topo;
+}
+
+// the machine's topology, limited to the cpus the process could run on when this was first called; read once
+inline const cpu_topology & get_cpu_topology() {
+	static const cpu_topology topo = read_cpu_topology("/sys/devices/system/cpu", detail::affinity_cpus());
+	return topo;
+}
+
+// Pin the calling thread to one logical cpu.  Returns false where that isn't supported or the cpu isn't usable.
+inline bool pin_current_thread(int cpu) {
+#if defined(__linux__)
+	if(cpu < 0 || cpu >= CPU_SETSIZE) {
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+}
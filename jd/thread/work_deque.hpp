@@ -0,0 +1,138 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+namespace jd {
+
+// ring_buffer -- an unsynchronized, growable FIFO/LIFO ring.
+// Unlike std::deque it never frees storage as it drains, so a queue that has reached its
+// working size pushes and pops without touching the heap.
+template<typename T>
+class ring_buffer {
+	std::vector<T> ring;    // size is always a power of two
+	size_t head;
+	size_t count;
+
+public:
+	explicit ring_buffer(size_t capacity = 64) : head(0), count(0) {
+		size_t n = 1;
+		while(n < capacity) {
+			n <<= 1;
+		}
+		ring.resize(n);
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	void push_back(T && t) {
+		if(count == ring.size()) {
+			grow();
+		}
+		ring[(head + count) & (ring.size() - 1)] = std::move(t);
+		++count;
+	}
+
+	// the popped slot is reset, so it doesn't keep captured state alive
+	bool pop_back(T & out) {
+		if(count == 0) {
+			return false;
+		}
+		--count;
+		T & slot = ring[(head + count) & (ring.size() - 1)];
+		out = std::move(slot);
+		slot = T();
+		return true;
+	}
+
+	bool pop_front(T & out) {
+		if(count == 0) {
+			return false;
+		}
+		T & slot = ring[head];
+		out = std::move(slot);
+		slot = T();
+		head = (head + 1) & (ring.size() - 1);
+		--count;
+		return true;
+	}
+
+private:
+	void grow() {
+		std::vector<T> bigger(ring.size() * 2);
+		for(size_t i = 0; i < count; i++) {
+			bigger[i] = std::move(ring[(head + i) & (ring.size() - 1)]);
+		}
+		ring.swap(bigger);
+		head = 0;
+	}
+};
+
+// work_deque -- a ring of tasks owned by a single worker.
+// The owner pushes and pops at the back (LIFO, the freshest task is the one most likely in cache),
+// thieves take from the front (FIFO, the oldest task is usually the biggest chunk of remaining work).
+// Each deque has its own lock, so the only contention is an owner and a thief meeting on the same deque,
+// instead of every producer and consumer meeting on one pool-wide lock.
+template<typename T>
+class work_deque {
+	std::mutex access;
+	ring_buffer<T> ring;
+	std::atomic<size_t> approx_count;   // readable without the lock, so empty deques can be skipped cheaply
+
+public:
+	explicit work_deque(size_t capacity = 64) : ring(capacity), approx_count(0) {
+	}
+
+	work_deque(const work_deque&) = delete;
+	work_deque& operator=(const work_deque&) = delete;
+
+	void push_back(T && t) {
+		std::lock_guard<std::mutex> lock(access);
+		ring.push_back(std::move(t));
+		approx_count.store(ring.size(), std::memory_order_relaxed);
+	}
+
+	// n items under one lock; moves from them
+	void push_back_batch(T * items, size_t n) {
+		std::lock_guard<std::mutex> lock(access);
+		for(size_t i = 0; i < n; i++) {
+			ring.push_back(std::move(items[i]));
+		}
+		approx_count.store(ring.size(), std::memory_order_relaxed);
+	}
+
+	// owner side
+	bool pop_back(T & out) {
+		if(approx_count.load(std::memory_order_relaxed) == 0) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(access);
+		if(!ring.pop_back(out)) {
+			return false;
+		}
+		approx_count.store(ring.size(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// thief side
+	bool steal_front(T & out) {
+		if(approx_count.load(std::memory_order_relaxed) == 0) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(access);
+		if(!ring.pop_front(out)) {
+			return false;
+		}
+		approx_count.store(ring.size(), std::memory_order_relaxed);
+		return true;
+	}
+
+	size_t size() const { return approx_count.load(std::memory_order_relaxed); }
+	bool empty() const { return size() == 0; }
+};
+
+}